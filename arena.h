@@ -0,0 +1,59 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <type_traits>
+
+// Linear allocator for data that only lives for one physics tick.
+// The block is allocated once, alloc() bumps a pointer and reset() frees
+// everything together, so steady state stepping never touches the heap.
+class Arena
+{
+public:
+	Arena(size_t size) : data(new char[size]), size(size), used(0) {}
+
+	~Arena()
+	{
+		delete[] data;
+	}
+
+	Arena(const Arena&) = delete;
+	Arena &operator=(const Arena&) = delete;
+
+	// Returns NULL when the arena is full rather than growing
+	template<typename T>
+	T* alloc(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "Arena never runs destructors");
+
+		size_t align = alignof(T);
+		size_t start = (used + align - 1) & ~(align - 1);
+		if (start + count * sizeof(T) > size)
+			return NULL;
+
+		used = start + count * sizeof(T);
+		return reinterpret_cast<T*>(data + start);
+	}
+
+	void reset()
+	{
+		used = 0;
+	}
+
+	size_t bytesUsed() const
+	{
+		return used;
+	}
+
+	size_t capacity() const
+	{
+		return size;
+	}
+
+private:
+	char *data;
+	size_t size;
+	size_t used;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// OpenGL Functionality
+#include "glad/glad.h"
+
+// GL Math Library
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+#include "model.h"
+#include "shader.h"
+
+// Every mesh in one vertex buffer and one VAO, so switching mesh is just a
+// different range of the same buffer rather than a state change
+class MeshBuffer
+{
+public:
+	unsigned int vao = 0;
+
+	MeshBuffer() {}
+
+	~MeshBuffer()
+	{
+		if (vao != 0)
+		{
+			glDeleteVertexArrays(1, &vao);
+			glDeleteBuffers(1, &vbo);
+		}
+	}
+
+	MeshBuffer(const MeshBuffer&) = delete;
+	MeshBuffer &operator=(const MeshBuffer&) = delete;
+
+	// Append a model's vertices and record where they went, call upload() after the last one
+	void add(Model &model)
+	{
+		model.first = (int)vertices.size();
+		model.count = (int)model.vertex.size();
+		vertices.insert(vertices.end(), model.vertex.begin(), model.vertex.end());
+	}
+
+	void upload()
+	{
+		glGenVertexArrays(1, &vao);
+		glGenBuffers(1, &vbo);
+
+		glBindVertexArray(vao);
+
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, vertex));
+		glEnableVertexAttribArray(0);
+
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normals));
+		glEnableVertexAttribArray(1);
+
+		glBindVertexArray(0);
+
+		// Only needed on the GPU from here
+		std::vector<Vertex>().swap(vertices);
+	}
+
+private:
+	unsigned int vbo = 0;
+	std::vector<Vertex> vertices;
+};
+
+// Same layout as GL's DrawArraysIndirectCommand
+struct DrawCommand
+{
+	unsigned int count;
+	unsigned int instance_count;
+	unsigned int first;
+	unsigned int base_instance;
+};
+
+// Draws collected over a frame and sent together.
+// With GL 4.3 the whole frame is one glMultiDrawArraysIndirect per colour,
+// each draw's model matrix read as a per instance attribute (locations 2-5)
+// picked by its base instance, so needs Shaders/BatchVertexShader.
+// On GL 3.3 it loops over glDrawArrays with a model uniform instead, still
+// without changing VAO between meshes.
+class DrawBatch
+{
+public:
+	DrawBatch(MeshBuffer &meshes, int max_draws, bool indirect) :
+		meshes(meshes), max_draws(max_draws), indirect(indirect && indirectAvailable())
+	{
+		draws.reserve(max_draws);
+		commands.reserve(max_draws);
+		matrices.reserve(max_draws);
+
+#ifdef GL_VERSION_4_3
+		if (this->indirect)
+		{
+			glGenBuffers(1, &command_buffer);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+			glBufferData(GL_DRAW_INDIRECT_BUFFER, max_draws * sizeof(DrawCommand), NULL, GL_STREAM_DRAW);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+			// Model matrix as four vec4 attributes, one per instance
+			glGenBuffers(1, &matrix_buffer);
+			glBindVertexArray(meshes.vao);
+			glBindBuffer(GL_ARRAY_BUFFER, matrix_buffer);
+			glBufferData(GL_ARRAY_BUFFER, max_draws * sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+			for (int i = 0; i < 4; i++)
+			{
+				glVertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(i * sizeof(glm::vec4)));
+				glEnableVertexAttribArray(2 + i);
+				glVertexAttribDivisor(2 + i, 1);
+			}
+			glBindVertexArray(0);
+		}
+#endif
+	}
+
+	~DrawBatch()
+	{
+		if (command_buffer != 0)
+			glDeleteBuffers(1, &command_buffer);
+		if (matrix_buffer != 0)
+			glDeleteBuffers(1, &matrix_buffer);
+	}
+
+	DrawBatch(const DrawBatch&) = delete;
+	DrawBatch &operator=(const DrawBatch&) = delete;
+
+	// Needs GL 4.3 from both the context and the GLAD loader
+	static bool indirectAvailable()
+	{
+#ifdef GL_VERSION_4_3
+		return GLAD_GL_VERSION_4_3 != 0;
+#else
+		return false;
+#endif
+	}
+
+	bool usingIndirect() const
+	{
+		return indirect;
+	}
+
+	void clear()
+	{
+		draws.clear();
+	}
+
+	// Queue a mesh from the shared buffer, draws past max_draws are ignored
+	void add(const Model &mesh, const glm::mat4 &model, glm::vec3 colour)
+	{
+		if ((int)draws.size() >= max_draws)
+			return;
+
+		Draw draw = { colour, model, (unsigned int)mesh.first, (unsigned int)mesh.count, (int)draws.size() };
+		draws.push_back(draw);
+	}
+
+	// Shader is the one in use, uniforms other than model and colour are left to the caller
+	void draw(Shader &shader)
+	{
+		if (draws.empty())
+			return;
+
+		// Same colour next to each other, otherwise in the order added
+		std::sort(draws.begin(), draws.end(), [](const Draw &a, const Draw &b)
+		{
+			if (a.colour.x != b.colour.x) return a.colour.x < b.colour.x;
+			if (a.colour.y != b.colour.y) return a.colour.y < b.colour.y;
+			if (a.colour.z != b.colour.z) return a.colour.z < b.colour.z;
+			return a.order < b.order;
+		});
+
+		glBindVertexArray(meshes.vao);
+		if (indirect)
+			drawIndirect(shader);
+		else
+		{
+			for (size_t i = 0; i < draws.size(); i++)
+			{
+				if (i == 0 || draws[i].colour != draws[i - 1].colour)
+					shader.setVec3("colour", draws[i].colour);
+				shader.setMat4("model", draws[i].model);
+				glDrawArrays(GL_TRIANGLES, draws[i].first, draws[i].count);
+			}
+		}
+		glBindVertexArray(0);
+	}
+
+private:
+	struct Draw
+	{
+		glm::vec3 colour;
+		glm::mat4 model;
+		unsigned int first;
+		unsigned int count;
+		int order;
+	};
+
+	MeshBuffer &meshes;
+	int max_draws;
+	bool indirect;
+
+	std::vector<Draw> draws;
+	std::vector<DrawCommand> commands;
+	std::vector<glm::mat4> matrices;
+
+	unsigned int command_buffer = 0;
+	unsigned int matrix_buffer = 0;
+
+	void drawIndirect(Shader &shader)
+	{
+#ifdef GL_VERSION_4_3
+		commands.clear();
+		matrices.clear();
+		for (const Draw &draw : draws)
+		{
+			DrawCommand command = { draw.count, 1, draw.first, (unsigned int)matrices.size() };
+			commands.push_back(command);
+			matrices.push_back(draw.model);
+		}
+
+		glBindBuffer(GL_ARRAY_BUFFER, matrix_buffer);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, matrices.size() * sizeof(glm::mat4), matrices.data());
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commands.size() * sizeof(DrawCommand), commands.data());
+
+		// One call per run of the same colour
+		size_t start = 0;
+		for (size_t i = 1; i <= draws.size(); i++)
+		{
+			if (i < draws.size() && draws[i].colour == draws[start].colour)
+				continue;
+
+			shader.setVec3("colour", draws[start].colour);
+			glMultiDrawArraysIndirect(GL_TRIANGLES, (void*)(start * sizeof(DrawCommand)), (GLsizei)(i - start), 0);
+			start = i;
+		}
+
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+	}
+};
+
+#endif
@@ -0,0 +1,547 @@
+// Physics microbenchmarks
+// Steps a set of canned scenes and reports cost per body per tick, heap
+// allocations per tick and cache misses per tick (Linux perf events only).
+// Results are written as JSON and can be checked against an earlier run.
+// Each scene also records a hash of the world state after the run, which must
+// match the baseline exactly when built with the same scalar type and ticks.
+//
+// Every run also checks determinism without a baseline: each scene is stepped
+// for CHECK_TICKS with every kernel available (plus a threaded one) and all
+// must end in the same state. A FIXED build must also match the reference
+// hashes below, which hold on any compiler and machine.
+//
+// Usage: bench [--scene name] [--ticks N] [--out results.json]
+//              [--baseline baseline.json] [--threshold 0.10]
+//              [--kernel name|auto] [--threads N]
+//
+// --kernel picks the stepping kernel (scalar, sse4.1, avx, avx512f, or one of
+// those with -mtN for N threads), auto times each on the scene and keeps the
+// fastest. State hashes are the same whichever kernel runs.
+//
+// Exits with 1 if any scene allocates once warmed up, is slower than the
+// baseline by more than the threshold, ends in a different state, or the
+// determinism check fails.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "physics.h"
+#include "kernels.h"
+
+// Count every heap allocation made by the process
+static std::atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size)
+{
+	allocations++;
+	void *p = std::malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	std::free(p);
+}
+
+// Hardware cache miss counter for the calling thread and every thread it
+// starts after the counter is made, so create it before the kernel when the
+// kernel brings its own worker threads
+struct CacheCounter
+{
+	int fd = -1;
+	uint64_t started = 0;
+
+	CacheCounter()
+	{
+#ifdef __linux__
+		perf_event_attr attr;
+		std::memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+
+	~CacheCounter()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
+
+	bool available() const { return fd >= 0; }
+
+	void start()
+	{
+#ifdef __linux__
+		// Inherited counts from threads that already exited can't be reset, so start from the current total
+		if (fd >= 0)
+		{
+			started = read();
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	uint64_t stop()
+	{
+		uint64_t misses = 0;
+#ifdef __linux__
+		if (fd >= 0)
+		{
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			misses = read() - started;
+		}
+#endif
+		return misses;
+	}
+
+private:
+	// Total for this thread and its children
+	uint64_t read()
+	{
+		uint64_t total = 0;
+#ifdef __linux__
+		if (::read(fd, &total, sizeof(total)) != sizeof(total))
+			total = 0;
+#endif
+		return total;
+	}
+};
+
+// Small fixed generator so scenes are identical on every machine and compiler
+struct SceneRandom
+{
+	uint32_t state;
+
+	SceneRandom(uint32_t seed) : state(seed) {}
+
+	float next(float min, float max)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return min + (max - min) * (state / 4294967296.0f);
+	}
+};
+
+// Same setup as the viewer - one ball dropped onto the floor
+void singleBall(World &world)
+{
+	Body ball;
+	ball.pos = Vec3<Real>(Real(0), Real(0), Real(-4));
+	world.addBody(ball);
+}
+
+// Spheres scattered through a column above the floor, falling onto it
+void fallingSpheres(World &world, int count)
+{
+	SceneRandom random(1234);
+
+	Material material;
+	material.restitution = Real(0.8);
+	world.setMaterial(0, material);
+
+	for (int i = 0; i < count; i++)
+	{
+		Body body;
+		body.rad = Real(0.1);
+		body.pos = Vec3<Real>(glm::vec3(random.next(-10, 10), random.next(0, 20), random.next(-10, 10)));
+		body.velocity = Vec3<Real>(glm::vec3(random.next(-0.01, 0.01), 0, random.next(-0.01, 0.01)));
+		world.addBody(body);
+	}
+}
+
+// Packed layers of spheres already resting on the floor, every body in contact every tick
+void densePile(World &world, int count)
+{
+	Material material;
+	material.restitution = Real(0.0);
+	world.setMaterial(0, material);
+
+	int side = 100;
+	for (int i = 0; i < count; i++)
+	{
+		Body body;
+		body.rad = Real(0.1);
+		body.pos = Vec3<Real>(Real((i % side) * 0.2f), world.params.floor_y + body.rad, Real(((i / side) % side) * 0.2f));
+		world.addBody(body);
+	}
+}
+
+// Falling spheres spread over several materials with a wind field over half
+// the floor, should cost the same per body as the single material scenes
+void mixedMaterials(World &world, int count)
+{
+	fallingSpheres(world, count);
+
+	SceneRandom random(5678);
+	int ids[8];
+	for (int &id : ids)
+	{
+		Material material;
+		material.restitution = Real(random.next(0.2f, 0.95f));
+		material.friction = Real(random.next(0.0f, 0.5f));
+		material.density = Real(random.next(0.5f, 4.0f));
+		id = world.addMaterial(material);
+	}
+
+	for (int i = 0; i < world.count; i++)
+		world.material[i] = (uint8_t)ids[i % 8];
+
+	ForceField wind;
+	wind.min = Vec3<Real>(Real(-10), Real(-10), Real(-10));
+	wind.max = Vec3<Real>(Real(0), Real(30), Real(10));
+	wind.force = Vec3<Real>(Real(0.001), Real(0), Real(0));
+	world.addField(wind);
+}
+
+struct Scene
+{
+	std::string name;
+	void (*build)(World &world, int count);
+	int count;
+};
+
+void buildSingle(World &world, int) { singleBall(world); }
+
+struct Result
+{
+	std::string name;
+	std::string kernel;
+	int bodies;
+	int ticks;
+	double ns_per_body_tick;
+	double allocs_per_tick;
+	double cache_misses_per_tick; // Negative when counters are unavailable
+	uint64_t state_hash;
+};
+
+// FNV-1a over the raw bytes of every body, so any difference in any bit shows up
+uint64_t hashWorld(const World &world)
+{
+	uint64_t hash = 14695981039346656037ull;
+	const Real *columns[] = { world.px, world.py, world.pz, world.vx, world.vy, world.vz, world.rad };
+
+	for (const Real *column : columns)
+	{
+		const unsigned char *bytes = (const unsigned char*)column;
+		for (size_t i = 0; i < world.count * sizeof(Real); i++)
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+Result runScene(const Scene &scene, int ticks, Kernel &kernel, CacheCounter &counter)
+{
+	World world(scene.count);
+	scene.build(world, scene.count);
+
+	float timestep = 1 / 60.0f;
+
+	// Warm up so first touch of the arrays is not measured
+	for (int i = 0; i < 10; i++)
+		kernel.step(world, timestep);
+
+	uint64_t allocs_before = allocations;
+
+	counter.start();
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ticks; i++)
+		kernel.step(world, timestep);
+	auto end = std::chrono::steady_clock::now();
+	uint64_t misses = counter.stop();
+
+	uint64_t allocs = allocations - allocs_before;
+	double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+	Result result;
+	result.name = scene.name;
+	result.kernel = kernel.name();
+	result.bodies = world.count;
+	result.ticks = ticks;
+	result.ns_per_body_tick = ns / ((double)ticks * world.count);
+	result.allocs_per_tick = (double)allocs / ticks;
+	result.cache_misses_per_tick = counter.available() ? (double)misses / ticks : -1;
+	result.state_hash = hashWorld(world);
+	return result;
+}
+
+void writeJSON(std::ostream &out, const std::vector<Result> &results)
+{
+	out << "{\n\t\"real\": \"" << PHYSICS_REAL_NAME << "\",\n\t\"scenes\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result &r = results[i];
+		out << "\t\t{ \"name\": \"" << r.name << "\", \"kernel\": \"" << r.kernel << "\", \"bodies\": " << r.bodies << ", \"ticks\": " << r.ticks
+			<< ", \"ns_per_body_tick\": " << r.ns_per_body_tick
+			<< ", \"allocs_per_tick\": " << r.allocs_per_tick
+			<< ", \"cache_misses_per_tick\": ";
+		if (r.cache_misses_per_tick < 0)
+			out << "null";
+		else
+			out << r.cache_misses_per_tick;
+
+		char hash[24];
+		std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)r.state_hash);
+		out << ", \"state_hash\": \"" << hash << "\" }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "\t]\n}\n";
+}
+
+// Pull the number following "key": out of a line written by writeJSON
+bool readField(const std::string &line, const std::string &key, std::string &value)
+{
+	size_t p = line.find("\"" + key + "\":");
+	if (p == std::string::npos)
+		return false;
+
+	p = line.find_first_not_of(" \"", p + key.size() + 3);
+	size_t end = line.find_first_of(",\"}", p);
+	value = line.substr(p, end - p);
+	return true;
+}
+
+// Ticks stepped by the determinism check, independent of --ticks so the reference hashes hold
+const int CHECK_TICKS = 60;
+
+#ifdef PHYSICS_REAL_FIXED
+// State of each scene after CHECK_TICKS with 32.32 fixed point. Only change
+// these when the physics is meant to change, the mismatch message prints the new value.
+struct Reference
+{
+	const char *name;
+	uint64_t hash;
+};
+
+const Reference reference_hashes[] = {
+	{ "single", 0xea7c18a862b70d21ull },
+	{ "fall_10k", 0x645247748ad3caeeull },
+	{ "fall_100k", 0x93442015d0f9bd42ull },
+	{ "pile_100k", 0xe1f39e11545ee1e5ull },
+	{ "mixed_100k", 0x867fc9c1322beb6eull },
+};
+#endif
+
+uint64_t checkRun(const Scene &scene, Kernel &kernel)
+{
+	World world(scene.count);
+	scene.build(world, scene.count);
+	for (int i = 0; i < CHECK_TICKS; i++)
+		kernel.step(world, 1 / 60.0f);
+	return hashWorld(world);
+}
+
+// Every kernel has to give the same state, and with FIXED the reference state
+bool checkDeterminism(const std::vector<Scene> &scenes, const std::string &only, int threads)
+{
+	std::vector<std::unique_ptr<Kernel>> kernels = availableKernels(threads > 1 ? threads : 2);
+
+	bool passed = true;
+	for (const Scene &scene : scenes)
+	{
+		if (!only.empty() && scene.name != only)
+			continue;
+
+		uint64_t first = checkRun(scene, *kernels[0]);
+		for (size_t k = 1; k < kernels.size(); k++)
+		{
+			uint64_t hash = checkRun(scene, *kernels[k]);
+			if (hash != first)
+			{
+				std::printf("MISMATCH   %s: %s gives %016llx, %s gives %016llx\n", scene.name.c_str(),
+					kernels[0]->name(), (unsigned long long)first, kernels[k]->name(), (unsigned long long)hash);
+				passed = false;
+			}
+		}
+
+#ifdef PHYSICS_REAL_FIXED
+		for (const Reference &r : reference_hashes)
+		{
+			if (scene.name == r.name && first != r.hash)
+			{
+				std::printf("MISMATCH   %s: state %016llx, reference %016llx\n", r.name,
+					(unsigned long long)first, (unsigned long long)r.hash);
+				passed = false;
+			}
+		}
+#endif
+	}
+	return passed;
+}
+
+// Compare against a baseline written by an earlier run, returns false on a regression
+bool checkBaseline(const std::string &filename, const std::vector<Result> &results, float threshold)
+{
+	std::ifstream file(filename);
+	if (!file.is_open())
+	{
+		std::cout << "Cannot open file: " << filename << std::endl;
+		return false;
+	}
+
+	bool passed = true;
+	std::string line, real;
+	while (std::getline(file, line))
+	{
+		readField(line, "real", real);
+
+		std::string name, value, ticks, hash;
+		if (!readField(line, "name", name) || !readField(line, "ns_per_body_tick", value))
+			continue;
+
+		double baseline = std::stod(value);
+		for (const Result &r : results)
+		{
+			if (r.name != name)
+				continue;
+
+			// State only has to match for the same scalar type and run length
+			if (real == PHYSICS_REAL_NAME && readField(line, "ticks", ticks) && std::stoi(ticks) == r.ticks
+				&& readField(line, "state_hash", hash) && std::stoull(hash, NULL, 16) != r.state_hash)
+			{
+				std::cout << "MISMATCH   " << name << ": world state differs from baseline" << std::endl;
+				passed = false;
+			}
+
+			double change = (r.ns_per_body_tick - baseline) / baseline;
+			bool regressed = change > threshold;
+			std::cout << (regressed ? "REGRESSION " : "ok         ") << name << ": "
+				<< baseline << " -> " << r.ns_per_body_tick << " ns/body/tick (" << change * 100 << "%)" << std::endl;
+
+			if (regressed)
+				passed = false;
+		}
+	}
+
+	return passed;
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<Scene> scenes = {
+		{ "single", buildSingle, 1 },
+		{ "fall_10k", fallingSpheres, 10000 },
+		{ "fall_100k", fallingSpheres, 100000 },
+		{ "pile_100k", densePile, 100000 },
+		{ "mixed_100k", mixedMaterials, 100000 },
+	};
+
+	std::string only;
+	std::string out_file;
+	std::string baseline_file;
+	float threshold = 0.10f;
+	int ticks = 600;
+	std::string kernel_name = "auto";
+	int threads = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+			only = argv[++i];
+		else if (std::strcmp(argv[i], "--ticks") == 0 && i + 1 < argc)
+			ticks = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+			out_file = argv[++i];
+		else if (std::strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+			baseline_file = argv[++i];
+		else if (std::strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+			threshold = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--kernel") == 0 && i + 1 < argc)
+			kernel_name = argv[++i];
+		else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = std::atoi(argv[++i]);
+		else
+		{
+			std::cout << "Unknown argument: " << argv[i] << std::endl;
+			return -1;
+		}
+	}
+
+	std::vector<Result> results;
+	for (const Scene &scene : scenes)
+	{
+		if (!only.empty() && scene.name != only)
+			continue;
+
+		// Scale ticks down for big scenes so each one takes similar time
+		int scene_ticks = scene.count > 1000 ? ticks / 10 : ticks * 100;
+		if (scene_ticks < 1)
+			scene_ticks = 1;
+
+		// Before the kernel so its worker threads are counted too
+		CacheCounter counter;
+
+		std::unique_ptr<Kernel> kernel = kernel_name == "auto"
+			? autoTuneKernel(scene.count, threads) : findKernel(kernel_name, threads);
+		if (!kernel)
+		{
+			std::cout << "Kernel not available on this CPU: " << kernel_name << std::endl;
+			return -1;
+		}
+
+		results.push_back(runScene(scene, scene_ticks, *kernel, counter));
+	}
+
+	writeJSON(std::cout, results);
+
+	if (!out_file.empty())
+	{
+		std::ofstream file(out_file);
+		if (!file.is_open())
+		{
+			std::cout << "Cannot open file: " << out_file << std::endl;
+			return -1;
+		}
+		writeJSON(file, results);
+	}
+
+	// Stepping must not touch the heap once the world is built
+	bool passed = true;
+	for (const Result &r : results)
+	{
+		if (r.allocs_per_tick > 0)
+		{
+			std::cout << "ALLOCATION " << r.name << ": " << r.allocs_per_tick << " heap allocations per tick" << std::endl;
+			passed = false;
+		}
+	}
+
+	if (!baseline_file.empty() && !checkBaseline(baseline_file, results, threshold))
+		passed = false;
+
+	if (!checkDeterminism(scenes, only, threads))
+		passed = false;
+
+	return passed ? 0 : 1;
+}
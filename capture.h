@@ -0,0 +1,294 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// OpenGL Functionality
+#include "glad/glad.h"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// Renders into an offscreen framebuffer and saves every frame to disk.
+//
+// Reading pixels straight back stalls until the GPU has finished the frame,
+// so each frame is copied into one of a ring of pixel buffer objects with a
+// fence, and only mapped a couple of frames later once the fence has passed.
+// Mapped pixels are handed to a background thread which writes either one
+// PPM per frame or a single raw RGB file for ffmpeg:
+//	ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -r 60 -i frames.rgb out.mp4
+class FrameCapture
+{
+public:
+	enum Format { PPM, RAW };
+
+	FrameCapture(int width, int height, const std::string &directory, Format format = PPM, int ring_size = 3) :
+		width(width), height(height), directory(directory), format(format), ring(ring_size < 2 ? 2 : ring_size)
+	{
+		// Colour and depth targets for the scene
+		glGenFramebuffers(1, &fbo);
+		glGenRenderbuffers(1, &colour);
+		glGenRenderbuffers(1, &depth);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glBindRenderbuffer(GL_RENDERBUFFER, colour);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colour);
+		glBindRenderbuffer(GL_RENDERBUFFER, depth);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth);
+
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			std::cout << "Capture framebuffer incomplete" << std::endl;
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		// Readback ring, RGBA keeps the copy on the driver's fast path
+		for (Slot &slot : ring)
+		{
+			glGenBuffers(1, &slot.pbo);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes(), NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		// CPU copies waiting for the writer, one more than the ring so the GL thread rarely waits
+		for (size_t i = 0; i < ring.size() + 1; i++)
+			free_frames.emplace_back(new unsigned char[frameBytes()]);
+		pending.reserve(free_frames.size());
+
+#ifdef _WIN32
+		_mkdir(directory.c_str());
+#else
+		mkdir(directory.c_str(), 0755);
+#endif
+		if (format == RAW)
+		{
+			video.open(directory + "/frames.rgb", std::ios::binary);
+			if (!video.is_open())
+				std::cout << "Cannot open file: " << directory << "/frames.rgb" << std::endl;
+		}
+
+		writer = std::thread(&FrameCapture::writeFrames, this);
+	}
+
+	// Saves any frames still in flight
+	~FrameCapture()
+	{
+		finish();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		queued.notify_one();
+		writer.join();
+
+		for (Slot &slot : ring)
+			glDeleteBuffers(1, &slot.pbo);
+		glDeleteRenderbuffers(1, &colour);
+		glDeleteRenderbuffers(1, &depth);
+		glDeleteFramebuffers(1, &fbo);
+
+		for (unsigned char *frame : free_frames)
+			delete[] frame;
+	}
+
+	FrameCapture(const FrameCapture&) = delete;
+	FrameCapture &operator=(const FrameCapture&) = delete;
+
+	// Render into the capture target instead of the window
+	void bind()
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, width, height);
+	}
+
+	// Call after the frame is drawn, starts its readback and collects any older frame that is ready
+	void capture()
+	{
+		// Ring full, the oldest frame has to come out first
+		if (in_flight == (int)ring.size())
+			collect(true);
+
+		Slot &slot = ring[(oldest + in_flight) % ring.size()];
+		slot.frame = next_frame++;
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		in_flight++;
+
+		// Take whatever else has already finished without waiting
+		while (in_flight > 0 && collect(false));
+	}
+
+	// Wait for every frame still on the GPU
+	void finish()
+	{
+		while (in_flight > 0)
+			collect(true);
+	}
+
+	int framesCaptured() const
+	{
+		return next_frame;
+	}
+
+private:
+	struct Slot
+	{
+		unsigned int pbo = 0;
+		GLsync fence = 0;
+		int frame = 0;
+	};
+
+	struct Frame
+	{
+		int number;
+		unsigned char *pixels;
+	};
+
+	int width, height;
+	std::string directory;
+	Format format;
+
+	unsigned int fbo = 0, colour = 0, depth = 0;
+	std::vector<Slot> ring;
+	int oldest = 0; // Ring slot of the oldest frame in flight
+	int in_flight = 0;
+	int next_frame = 0;
+
+	// Shared with the writer thread
+	std::vector<unsigned char*> free_frames;
+	std::vector<Frame> pending;
+	bool stopping = false;
+	std::mutex mutex;
+	std::condition_variable queued, returned;
+	std::thread writer;
+	std::ofstream video;
+
+	size_t frameBytes() const
+	{
+		return (size_t)width * height * 4;
+	}
+
+	// Copy the oldest frame out of its buffer, returns false if wait is false and it isn't ready
+	bool collect(bool wait)
+	{
+		Slot &slot = ring[oldest];
+		GLenum status = glClientWaitSync(slot.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000ull : 0);
+		if (status == GL_TIMEOUT_EXPIRED)
+		{
+			if (!wait)
+				return false;
+			while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) == GL_TIMEOUT_EXPIRED);
+		}
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+
+		// Writer being slower than the GPU is the one place this thread waits
+		unsigned char *pixels;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			returned.wait(lock, [&]() { return !free_frames.empty(); });
+			pixels = free_frames.back();
+			free_frames.pop_back();
+		}
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameBytes(), GL_MAP_READ_BIT);
+		if (mapped)
+		{
+			std::memcpy(pixels, mapped, frameBytes());
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		else
+			std::memset(pixels, 0, frameBytes());
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending.push_back({ slot.frame, pixels });
+		}
+		queued.notify_one();
+
+		oldest = (oldest + 1) % ring.size();
+		in_flight--;
+		return true;
+	}
+
+	void writeFrames()
+	{
+		// RGB rows, top first, GL gives bottom first
+		std::vector<unsigned char> rgb((size_t)width * height * 3);
+
+		while (true)
+		{
+			Frame frame;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				queued.wait(lock, [&]() { return stopping || !pending.empty(); });
+				if (pending.empty())
+					return;
+				frame = pending.front();
+				pending.erase(pending.begin());
+			}
+
+			for (int y = 0; y < height; y++)
+			{
+				const unsigned char *src = frame.pixels + (size_t)(height - 1 - y) * width * 4;
+				unsigned char *dst = rgb.data() + (size_t)y * width * 3;
+				for (int x = 0; x < width; x++)
+				{
+					dst[x * 3 + 0] = src[x * 4 + 0];
+					dst[x * 3 + 1] = src[x * 4 + 1];
+					dst[x * 3 + 2] = src[x * 4 + 2];
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				free_frames.push_back(frame.pixels);
+			}
+			returned.notify_one();
+
+			if (format == RAW)
+				video.write((const char*)rgb.data(), rgb.size());
+			else
+				writePPM(frame.number, rgb);
+		}
+	}
+
+	void writePPM(int number, const std::vector<unsigned char> &rgb)
+	{
+		char name[32];
+		std::snprintf(name, sizeof(name), "/frame_%06d.ppm", number);
+
+		std::ofstream file(directory + name, std::ios::binary);
+		if (!file.is_open())
+		{
+			std::cout << "Cannot open file: " << directory << name << std::endl;
+			return;
+		}
+
+		file << "P6\n" << width << " " << height << "\n255\n";
+		file.write((const char*)rgb.data(), rgb.size());
+	}
+};
+
+#endif
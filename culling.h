@@ -0,0 +1,105 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+// GL Math Library - https://github.com/g-truc/glm
+#include <glm/glm.hpp>
+
+#include <cmath>
+
+// Bounding sphere frustum culling and level of detail selection.
+// Bodies are passed as separate x, y, z, radius arrays so the loop has no
+// branches and the compiler can run it several bodies at a time.
+
+const int MAX_LOD = 4;
+
+struct Frustum
+{
+	// Plane i is a[i] * x + b[i] * y + c[i] * z + d[i] >= 0 on the inside
+	float a[6], b[6], c[6], d[6];
+};
+
+// Pull the six planes out of projection * view (Gribb & Hartmann)
+inline Frustum extractFrustum(const glm::mat4 &view_projection)
+{
+	const glm::mat4 &m = view_projection;
+	Frustum f;
+
+	for (int i = 0; i < 6; i++)
+	{
+		int row = i / 2; // x, y, z
+		float sign = (i % 2 == 0) ? 1.0f : -1.0f; // left/bottom/near then right/top/far
+
+		float a = m[0][3] + sign * m[0][row];
+		float b = m[1][3] + sign * m[1][row];
+		float c = m[2][3] + sign * m[2][row];
+		float d = m[3][3] + sign * m[3][row];
+
+		// Normalise so the distance can be compared against a radius
+		float len = std::sqrt(a * a + b * b + c * c);
+		f.a[i] = a / len;
+		f.b[i] = b / len;
+		f.c[i] = c / len;
+		f.d[i] = d / len;
+	}
+
+	return f;
+}
+
+struct CullParams
+{
+	Frustum frustum;
+	glm::vec3 eye;
+
+	// Diameter in pixels = 2 * radius * pixel_scale / distance
+	float pixel_scale;
+
+	// Smallest on screen diameter for levels 0 to MAX_LOD - 2, level 0 is full detail.
+	// Leave unused levels at 0 so nothing falls under them.
+	float lod_pixels[MAX_LOD - 1] = { 0 };
+};
+
+// projection[1][1] is 1 / tan(fov / 2), half the screen height covers that at distance 1
+inline float lodPixelScale(const glm::mat4 &projection, float screen_height)
+{
+	return projection[1][1] * screen_height * 0.5f;
+}
+
+// Writes the mesh level for each body to lod, or -1 if it is off screen
+inline void cullBodies(const CullParams &params, const float *x, const float *y, const float *z, const float *r,
+	int count, signed char *lod)
+{
+	// Local copies, lod is a char pointer so could otherwise alias the parameters
+	const Frustum f = params.frustum;
+	const glm::vec3 eye = params.eye;
+	const float pixel_scale = params.pixel_scale;
+	float lod_pixels_sq[MAX_LOD - 1];
+	for (int l = 0; l < MAX_LOD - 1; l++)
+		lod_pixels_sq[l] = params.lod_pixels[l] * params.lod_pixels[l];
+
+	for (int i = 0; i < count; i++)
+	{
+		// Smallest signed distance to any plane, inside all of them if >= -radius
+		float dist = f.a[0] * x[i] + f.b[0] * y[i] + f.c[0] * z[i] + f.d[0];
+		for (int p = 1; p < 6; p++)
+		{
+			float plane = f.a[p] * x[i] + f.b[p] * y[i] + f.c[p] * z[i] + f.d[p];
+			dist = plane < dist ? plane : dist;
+		}
+
+		float dx = x[i] - eye.x;
+		float dy = y[i] - eye.y;
+		float dz = z[i] - eye.z;
+		float eye_dist_sq = dx * dx + dy * dy + dz * dz;
+		float size = 2.0f * r[i] * pixel_scale;
+
+		// Count how many thresholds the body falls under, squared to avoid the sqrt
+		int level = 0;
+		for (int l = 0; l < MAX_LOD - 1; l++)
+			level += size * size < lod_pixels_sq[l] * eye_dist_sq;
+
+		// All bits set (-1) when outside
+		lod[i] = (signed char)(level | -(int)(dist < -r[i]));
+	}
+}
+
+#endif
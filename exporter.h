@@ -0,0 +1,406 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#ifdef PHYSICS_ZLIB
+#include <zlib.h>
+#endif
+
+#include "physics.h"
+
+// Streams body positions and velocities to a file while the simulation runs.
+//
+// record() copies the world into a free page and returns, a background thread
+// encodes and writes full pages. If the writer falls behind and no page is
+// free the sample is dropped and counted rather than blocking the tick.
+//
+// File layout (little endian):
+//	header	"PTRJ", uint32 version, uint32 sizeof(Real), char[8] Real name,
+//			uint32 sample interval in ticks, uint32 flags (1 = zlib)
+//	chunk	uint64 tick, uint32 body count, uint32 stored size, uint32 encoded size,
+//			then stored size bytes (zlib compressed when the flag is set)
+//
+// An encoded chunk is the columns px, py, pz, vx, vy, vz one after another.
+// Each value is XORed with the same body's value in the previous chunk and
+// written as a LEB128 varint, so values that barely changed take a byte or two.
+class TrajectoryWriter
+{
+public:
+	static const uint32_t VERSION = 1;
+	static const uint32_t FLAG_ZLIB = 1;
+	static const int COLUMNS = 6;
+
+	// capacity is the most bodies a sample can hold, every is the sample interval in ticks
+	TrajectoryWriter(const std::string &filename, int capacity, int every = 1, int page_count = 2) :
+		capacity(capacity), every(every < 1 ? 1 : every), pages(page_count < 2 ? 2 : page_count),
+		previous(new uint64_t[(size_t)capacity * COLUMNS]())
+	{
+		for (Page &page : pages)
+			page.data.reset(new Real[(size_t)capacity * COLUMNS]()); // Touch now so the first samples do not page fault
+
+		// Worst case is a full length varint for every value
+		encoded.resize((size_t)capacity * COLUMNS * MAX_VARINT);
+#ifdef PHYSICS_ZLIB
+		compressed.resize(compressBound((uLong)encoded.size()));
+		flags |= FLAG_ZLIB;
+#endif
+
+		file.open(filename, std::ios::binary);
+		if (!file.is_open())
+		{
+			std::cout << "Cannot open file: " << filename << std::endl;
+			return;
+		}
+
+		char name[8] = {};
+		std::strncpy(name, PHYSICS_REAL_NAME, sizeof(name));
+		uint32_t version = VERSION;
+		uint32_t real_size = sizeof(Real);
+		uint32_t interval = this->every;
+
+		file.write("PTRJ", 4);
+		file.write((const char*)&version, sizeof(version));
+		file.write((const char*)&real_size, sizeof(real_size));
+		file.write(name, sizeof(name));
+		file.write((const char*)&interval, sizeof(interval));
+		file.write((const char*)&flags, sizeof(flags));
+
+		writer = std::thread(&TrajectoryWriter::writePages, this);
+	}
+
+	// Writes any samples still queued before closing the file
+	~TrajectoryWriter()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		ready.notify_one();
+
+		if (writer.joinable())
+			writer.join();
+	}
+
+	TrajectoryWriter(const TrajectoryWriter&) = delete;
+	TrajectoryWriter &operator=(const TrajectoryWriter&) = delete;
+
+	bool isOpen() const { return file.is_open() && !failed; }
+
+	// Call once per tick from the simulation thread, only every Nth tick is kept.
+	// Never blocks on the disk, returns false if the sample was dropped.
+	bool record(const World &world, uint64_t tick)
+	{
+		if (tick % every != 0 || !file.is_open())
+			return true;
+
+		if (failed)
+		{
+			dropped++;
+			return false;
+		}
+
+		Page *page = NULL;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (filled - written < pages.size())
+				page = &pages[filled % pages.size()];
+		}
+
+		if (!page)
+		{
+			dropped++;
+			return false;
+		}
+
+		// Only this thread touches a page between the check above and filled++
+		int count = world.count < capacity ? world.count : capacity;
+		const Real *columns[COLUMNS] = { world.px, world.py, world.pz, world.vx, world.vy, world.vz };
+		for (int c = 0; c < COLUMNS; c++)
+			std::memcpy(page->data.get() + (size_t)c * count, columns[c], count * sizeof(Real));
+		page->tick = tick;
+		page->count = count;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			filled++;
+		}
+		ready.notify_one();
+
+		recorded++;
+		return true;
+	}
+
+	uint64_t samplesRecorded() const { return recorded; }
+	uint64_t samplesDropped() const { return dropped; } // Including samples that failed to write
+	uint64_t bytesWritten() const { return bytes; }
+
+private:
+	static const int MAX_VARINT = (sizeof(Real) * 8 + 6) / 7;
+
+	struct Page
+	{
+		uint64_t tick = 0;
+		int count = 0;
+		std::unique_ptr<Real[]> data; // count values per column
+	};
+
+	int capacity;
+	int every;
+	uint32_t flags = 0;
+	std::ofstream file;
+
+	std::vector<Page> pages;
+	size_t filled = 0; // Pages handed to the writer so far
+	size_t written = 0; // Pages the writer has finished with
+	bool stopping = false;
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::thread writer;
+
+	// Only used by the writer thread
+	std::unique_ptr<uint64_t[]> previous; // Bits of each value in the last chunk written
+	std::vector<unsigned char> encoded;
+	std::vector<unsigned char> compressed;
+
+	std::atomic<bool> failed{false}; // Set by the writer when the file can't be written
+	std::atomic<uint64_t> recorded{0};
+	std::atomic<uint64_t> dropped{0};
+	std::atomic<uint64_t> bytes{0};
+
+	static uint64_t bits(Real v)
+	{
+		uint64_t b = 0;
+		std::memcpy(&b, &v, sizeof(Real));
+		return b;
+	}
+
+	void writePages()
+	{
+		while (true)
+		{
+			Page *page;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [&]() { return stopping || written != filled; });
+				if (written == filled)
+					return; // Stopping and nothing left to write
+				page = &pages[written % pages.size()];
+			}
+
+			writePage(*page);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				written++;
+			}
+		}
+	}
+
+	void writePage(const Page &page)
+	{
+		if (failed)
+		{
+			recorded--;
+			dropped++;
+			return;
+		}
+
+		// XOR against the last chunk, then varint. previous is left alone until
+		// the chunk is on disk, so a failed chunk doesn't break the ones after it
+		unsigned char *out = encoded.data();
+		for (int c = 0; c < COLUMNS; c++)
+		{
+			const Real *column = page.data.get() + (size_t)c * page.count;
+			const uint64_t *last = previous.get() + (size_t)c * capacity;
+			for (int i = 0; i < page.count; i++)
+			{
+				uint64_t x = bits(column[i]) ^ last[i];
+
+				while (x >= 0x80)
+				{
+					*out++ = (unsigned char)(x | 0x80);
+					x >>= 7;
+				}
+				*out++ = (unsigned char)x;
+			}
+		}
+
+		uint32_t encoded_size = (uint32_t)(out - encoded.data());
+		const unsigned char *stored = encoded.data();
+		uint32_t stored_size = encoded_size;
+
+#ifdef PHYSICS_ZLIB
+		uLongf size = (uLongf)compressed.size();
+		if (compress2(compressed.data(), &size, encoded.data(), encoded_size, Z_BEST_SPEED) != Z_OK)
+		{
+			std::cout << "Trajectory compression failed at tick " << page.tick << std::endl;
+			recorded--;
+			dropped++;
+			return;
+		}
+		stored = compressed.data();
+		stored_size = (uint32_t)size;
+#endif
+
+		uint32_t count = page.count;
+		file.write((const char*)&page.tick, sizeof(page.tick));
+		file.write((const char*)&count, sizeof(count));
+		file.write((const char*)&stored_size, sizeof(stored_size));
+		file.write((const char*)&encoded_size, sizeof(encoded_size));
+		file.write((const char*)stored, stored_size);
+		file.flush();
+
+		if (!file)
+		{
+			// Can't tell how much of the chunk made it, so nothing after it would decode
+			std::cout << "Trajectory write failed at tick " << page.tick << ", recording stopped" << std::endl;
+			failed = true;
+			recorded--;
+			dropped++;
+			return;
+		}
+
+		bytes += sizeof(page.tick) + 3 * sizeof(uint32_t) + stored_size;
+
+		// Chunk is written, it is now what the next one is XORed against
+		for (int c = 0; c < COLUMNS; c++)
+		{
+			const Real *column = page.data.get() + (size_t)c * page.count;
+			uint64_t *last = previous.get() + (size_t)c * capacity;
+			for (int i = 0; i < page.count; i++)
+				last[i] = bits(column[i]);
+		}
+	}
+};
+
+// Reads back a file written by TrajectoryWriter, one sample at a time
+class TrajectoryReader
+{
+public:
+	struct Sample
+	{
+		uint64_t tick = 0;
+		int count = 0;
+		std::vector<Real> px, py, pz, vx, vy, vz;
+	};
+
+	TrajectoryReader(const std::string &filename) : file(filename, std::ios::binary)
+	{
+		if (!file.is_open())
+		{
+			std::cout << "Cannot open file: " << filename << std::endl;
+			return;
+		}
+
+		char magic[4], name[8];
+		uint32_t version, real_size;
+		file.read(magic, 4);
+		file.read((char*)&version, sizeof(version));
+		file.read((char*)&real_size, sizeof(real_size));
+		file.read(name, sizeof(name));
+		file.read((char*)&every, sizeof(every));
+		file.read((char*)&flags, sizeof(flags));
+
+		if (!file || std::memcmp(magic, "PTRJ", 4) != 0 || version != TrajectoryWriter::VERSION)
+			std::cout << "Not a trajectory file: " << filename << std::endl;
+		else if (real_size != sizeof(Real) || std::strncmp(name, PHYSICS_REAL_NAME, sizeof(name)) != 0)
+			std::cout << "Trajectory was recorded with a different scalar type: " << std::string(name, strnlen(name, sizeof(name))) << std::endl;
+#ifndef PHYSICS_ZLIB
+		else if (flags & TrajectoryWriter::FLAG_ZLIB)
+			std::cout << "Trajectory is compressed, rebuild with zlib to read it" << std::endl;
+#endif
+		else
+			valid = true;
+	}
+
+	bool isOpen() const { return valid; }
+
+	// Sample interval in ticks
+	uint32_t interval() const { return every; }
+
+	// Returns false at the end of the file or on a damaged chunk
+	bool next(Sample &sample)
+	{
+		if (!valid)
+			return false;
+
+		uint32_t count, stored_size, encoded_size;
+		file.read((char*)&sample.tick, sizeof(sample.tick));
+		file.read((char*)&count, sizeof(count));
+		file.read((char*)&stored_size, sizeof(stored_size));
+		file.read((char*)&encoded_size, sizeof(encoded_size));
+		if (!file)
+			return false;
+
+		stored.resize(stored_size);
+		file.read((char*)stored.data(), stored_size);
+		if (!file)
+			return false;
+
+		const unsigned char *in = stored.data();
+#ifdef PHYSICS_ZLIB
+		if (flags & TrajectoryWriter::FLAG_ZLIB)
+		{
+			encoded.resize(encoded_size);
+			uLongf size = encoded_size;
+			if (uncompress(encoded.data(), &size, stored.data(), stored_size) != Z_OK || size != encoded_size)
+				return false;
+			in = encoded.data();
+		}
+#endif
+		const unsigned char *end = in + encoded_size;
+
+		sample.count = count;
+		std::vector<Real> *columns[] = { &sample.px, &sample.py, &sample.pz, &sample.vx, &sample.vy, &sample.vz };
+		for (int c = 0; c < TrajectoryWriter::COLUMNS; c++)
+		{
+			std::vector<Real> &column = *columns[c];
+			column.resize(count);
+
+			// Bodies past the end keep their last value, same as in the writer
+			if (previous[c].size() < count)
+				previous[c].resize(count, 0);
+			uint64_t *last = previous[c].data();
+			for (uint32_t i = 0; i < count; i++)
+			{
+				uint64_t x = 0;
+				for (int shift = 0; ; shift += 7)
+				{
+					if (in == end)
+						return false;
+					unsigned char byte = *in++;
+					x |= (uint64_t)(byte & 0x7f) << shift;
+					if (!(byte & 0x80))
+						break;
+				}
+
+				last[i] ^= x;
+				std::memcpy(&column[i], &last[i], sizeof(Real));
+			}
+		}
+		return true;
+	}
+
+private:
+	std::ifstream file;
+	uint32_t every = 1;
+	uint32_t flags = 0;
+	bool valid = false;
+
+	std::vector<uint64_t> previous[TrajectoryWriter::COLUMNS];
+	std::vector<unsigned char> stored;
+	std::vector<unsigned char> encoded;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <cstdint>
+#include <cmath>
+
+// 32.32 fixed point number.
+// Integer arithmetic gives the same bits on every compiler, CPU and set of
+// floating point flags, so runs can be compared exactly across machines.
+// Range is about +-2 billion with a step of 2^-32.
+struct Fixed
+{
+	int64_t raw;
+
+	Fixed() : raw(0) {}
+	Fixed(int v) : raw((int64_t)v * ONE) {}
+	explicit Fixed(float v) : raw(fromDouble(v)) {}
+	explicit Fixed(double v) : raw(fromDouble(v)) {}
+
+	static Fixed fromRaw(int64_t raw)
+	{
+		Fixed f;
+		f.raw = raw;
+		return f;
+	}
+
+	explicit operator float() const { return (float)toDouble(); }
+	explicit operator double() const { return toDouble(); }
+
+	Fixed operator+(Fixed o) const { return fromRaw((int64_t)((uint64_t)raw + (uint64_t)o.raw)); }
+	Fixed operator-(Fixed o) const { return fromRaw((int64_t)((uint64_t)raw - (uint64_t)o.raw)); }
+	Fixed operator-() const { return fromRaw((int64_t)(0 - (uint64_t)raw)); }
+	Fixed operator*(Fixed o) const { return fromRaw(multiply(raw, o.raw)); }
+
+	Fixed &operator+=(Fixed o) { return *this = *this + o; }
+	Fixed &operator-=(Fixed o) { return *this = *this - o; }
+	Fixed &operator*=(Fixed o) { return *this = *this * o; }
+
+	bool operator<(Fixed o) const { return raw < o.raw; }
+	bool operator>(Fixed o) const { return raw > o.raw; }
+	bool operator<=(Fixed o) const { return raw <= o.raw; }
+	bool operator>=(Fixed o) const { return raw >= o.raw; }
+	bool operator==(Fixed o) const { return raw == o.raw; }
+	bool operator!=(Fixed o) const { return raw != o.raw; }
+
+private:
+	static const int64_t ONE = (int64_t)1 << 32;
+
+	static int64_t fromDouble(double v)
+	{
+		return (int64_t)std::llround(v * 4294967296.0);
+	}
+
+	double toDouble() const
+	{
+		return (double)raw / 4294967296.0;
+	}
+
+	// (a * b) >> 32 without a 128 bit type, split into 32 bit halves.
+	// Rounds towards negative infinity like an arithmetic shift.
+	static int64_t multiply(int64_t a, int64_t b)
+	{
+		int64_t a_hi = a >> 32;
+		int64_t b_hi = b >> 32;
+		uint64_t a_lo = (uint64_t)a & 0xffffffffu;
+		uint64_t b_lo = (uint64_t)b & 0xffffffffu;
+
+		// Unsigned multiplies so overflow wraps instead of being undefined
+		uint64_t hi = ((uint64_t)a_hi * (uint64_t)b_hi) << 32;
+		uint64_t mid = (uint64_t)a_hi * b_lo + a_lo * (uint64_t)b_hi;
+		uint64_t lo = (a_lo * b_lo) >> 32;
+
+		return (int64_t)(hi + mid + lo);
+	}
+};
+
+#endif
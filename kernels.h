@@ -0,0 +1,539 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "physics.h"
+
+// Interchangeable implementations of World stepping (integration and floor
+// collision): scalar, SIMD for each x86 vector width, and any of those split
+// across threads. availableKernels() probes the CPU at runtime so one binary
+// runs everywhere, and autoTuneKernel() times each one and keeps the fastest.
+// Every kernel gives bit identical results to the scalar one.
+
+#if defined(PHYSICS_REAL_FLOAT) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define PHYSICS_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Lets one function use instructions the rest of the build was not compiled for
+#if defined(__GNUC__) || defined(__clang__)
+#define PHYSICS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PHYSICS_TARGET(isa)
+#endif
+
+class Kernel
+{
+public:
+	virtual ~Kernel() {}
+
+	virtual const char* name() const = 0;
+
+	// Step bodies [begin, end), writes their contacts to out and returns how many
+	virtual int stepRange(World &world, Real dt, int begin, int end, World::Contact *out) = 0;
+
+	// Step the whole world, same result as World::step
+	virtual int step(World &world, float timestep)
+	{
+		world.beginStep(Real(timestep));
+		world.contact_count = stepRange(world, Real(timestep), 0, world.count, world.contacts);
+		return world.contact_count;
+	}
+};
+
+class ScalarKernel : public Kernel
+{
+public:
+	const char* name() const { return "scalar"; }
+
+	int stepRange(World &world, Real dt, int begin, int end, World::Contact *out)
+	{
+		return world.stepRange(begin, end, dt, out);
+	}
+};
+
+#ifdef PHYSICS_SIMD_X86
+
+// Each SIMD kernel does the same operations in the same order as stepBody,
+// a lane at a time falls back to the scalar code for the last few bodies.
+// Force fields are applied by stepInBlocks, like World::stepRange, so they
+// are split across threads along with the rest of the step.
+// Contact values are looked up per lane by material id, so a mix of
+// materials costs the same as one.
+
+// Force fields then the step over blocks of World::FIELD_BLOCK bodies, so the
+// second pass finds the bodies still in cache. Blocks are a multiple of 16,
+// so only the last one runs a scalar tail.
+template<typename F>
+inline int stepInBlocks(World &w, float dt, int begin, int end, World::Contact *out, F step)
+{
+	int hits = 0;
+	for (int b = begin; b < end; b += World::FIELD_BLOCK)
+	{
+		int e = b + World::FIELD_BLOCK < end ? b + World::FIELD_BLOCK : end;
+		w.applyFields(b, e);
+		hits += step(w, dt, b, e, out + hits);
+	}
+	return hits;
+}
+
+PHYSICS_TARGET("sse4.1")
+inline int stepSSE41(World &w, float dt, int begin, int end, World::Contact *out)
+{
+	const SimParams &p = w.params;
+	const __m128 gx = _mm_set1_ps(p.gravity.x * dt);
+	const __m128 gy = _mm_set1_ps(p.gravity.y * dt);
+	const __m128 gz = _mm_set1_ps(p.gravity.z * dt);
+	const __m128 floor_y = _mm_set1_ps(p.floor_y);
+	const float *rest = w.contactRestitution();
+	const float *keep = w.contactKeep();
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 sign = _mm_set1_ps(-0.0f);
+
+	int hits = 0;
+	int i = begin;
+	for (; i + 4 <= end; i += 4)
+	{
+		__m128 vx = _mm_add_ps(_mm_loadu_ps(w.vx + i), gx);
+		__m128 vy = _mm_add_ps(_mm_loadu_ps(w.vy + i), gy);
+		__m128 vz = _mm_add_ps(_mm_loadu_ps(w.vz + i), gz);
+		__m128 px = _mm_add_ps(_mm_loadu_ps(w.px + i), vx);
+		__m128 py = _mm_add_ps(_mm_loadu_ps(w.py + i), vy);
+		__m128 pz = _mm_add_ps(_mm_loadu_ps(w.pz + i), vz);
+
+		// Rebound where below the radius and moving down
+		__m128 dif = _mm_sub_ps(py, floor_y);
+		__m128 hit = _mm_and_ps(_mm_cmplt_ps(dif, _mm_loadu_ps(w.rad + i)), _mm_cmplt_ps(vy, zero));
+		const uint8_t *m = w.material + i;
+		__m128 restitution = _mm_setr_ps(rest[m[0]], rest[m[1]], rest[m[2]], rest[m[3]]);
+		__m128 kept = _mm_setr_ps(keep[m[0]], keep[m[1]], keep[m[2]], keep[m[3]]);
+		vy = _mm_blendv_ps(vy, _mm_mul_ps(_mm_xor_ps(vy, sign), restitution), hit);
+		vx = _mm_blendv_ps(vx, _mm_mul_ps(vx, kept), hit);
+		vz = _mm_blendv_ps(vz, _mm_mul_ps(vz, kept), hit);
+
+		_mm_storeu_ps(w.px + i, px); _mm_storeu_ps(w.py + i, py); _mm_storeu_ps(w.pz + i, pz);
+		_mm_storeu_ps(w.vx + i, vx); _mm_storeu_ps(w.vy + i, vy); _mm_storeu_ps(w.vz + i, vz);
+
+		int mask = _mm_movemask_ps(hit);
+		for (int lane = 0; mask != 0; lane++, mask >>= 1)
+			if (mask & 1)
+				out[hits++] = { i + lane, w.vy[i + lane] };
+	}
+
+	return hits + w.stepBodies(i, end, dt, out + hits);
+}
+
+PHYSICS_TARGET("avx")
+inline int stepAVX(World &w, float dt, int begin, int end, World::Contact *out)
+{
+	const SimParams &p = w.params;
+	const __m256 gx = _mm256_set1_ps(p.gravity.x * dt);
+	const __m256 gy = _mm256_set1_ps(p.gravity.y * dt);
+	const __m256 gz = _mm256_set1_ps(p.gravity.z * dt);
+	const __m256 floor_y = _mm256_set1_ps(p.floor_y);
+	const float *rest = w.contactRestitution();
+	const float *keep = w.contactKeep();
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+
+	int hits = 0;
+	int i = begin;
+	for (; i + 8 <= end; i += 8)
+	{
+		__m256 vx = _mm256_add_ps(_mm256_loadu_ps(w.vx + i), gx);
+		__m256 vy = _mm256_add_ps(_mm256_loadu_ps(w.vy + i), gy);
+		__m256 vz = _mm256_add_ps(_mm256_loadu_ps(w.vz + i), gz);
+		__m256 px = _mm256_add_ps(_mm256_loadu_ps(w.px + i), vx);
+		__m256 py = _mm256_add_ps(_mm256_loadu_ps(w.py + i), vy);
+		__m256 pz = _mm256_add_ps(_mm256_loadu_ps(w.pz + i), vz);
+
+		__m256 dif = _mm256_sub_ps(py, floor_y);
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(dif, _mm256_loadu_ps(w.rad + i), _CMP_LT_OQ), _mm256_cmp_ps(vy, zero, _CMP_LT_OQ));
+		const uint8_t *m = w.material + i;
+		__m256 restitution = _mm256_setr_ps(rest[m[0]], rest[m[1]], rest[m[2]], rest[m[3]], rest[m[4]], rest[m[5]], rest[m[6]], rest[m[7]]);
+		__m256 kept = _mm256_setr_ps(keep[m[0]], keep[m[1]], keep[m[2]], keep[m[3]], keep[m[4]], keep[m[5]], keep[m[6]], keep[m[7]]);
+		vy = _mm256_blendv_ps(vy, _mm256_mul_ps(_mm256_xor_ps(vy, sign), restitution), hit);
+		vx = _mm256_blendv_ps(vx, _mm256_mul_ps(vx, kept), hit);
+		vz = _mm256_blendv_ps(vz, _mm256_mul_ps(vz, kept), hit);
+
+		_mm256_storeu_ps(w.px + i, px); _mm256_storeu_ps(w.py + i, py); _mm256_storeu_ps(w.pz + i, pz);
+		_mm256_storeu_ps(w.vx + i, vx); _mm256_storeu_ps(w.vy + i, vy); _mm256_storeu_ps(w.vz + i, vz);
+
+		int mask = _mm256_movemask_ps(hit);
+		for (int lane = 0; mask != 0; lane++, mask >>= 1)
+			if (mask & 1)
+				out[hits++] = { i + lane, w.vy[i + lane] };
+	}
+
+	return hits + w.stepBodies(i, end, dt, out + hits);
+}
+
+PHYSICS_TARGET("avx512f")
+inline int stepAVX512(World &w, float dt, int begin, int end, World::Contact *out)
+{
+	const SimParams &p = w.params;
+	const __m512 gx = _mm512_set1_ps(p.gravity.x * dt);
+	const __m512 gy = _mm512_set1_ps(p.gravity.y * dt);
+	const __m512 gz = _mm512_set1_ps(p.gravity.z * dt);
+	const __m512 floor_y = _mm512_set1_ps(p.floor_y);
+	const float *rest = w.contactRestitution();
+	const float *keep = w.contactKeep();
+	const __m512 zero = _mm512_setzero_ps();
+
+	int hits = 0;
+	int i = begin;
+	for (; i + 16 <= end; i += 16)
+	{
+		__m512 vx = _mm512_add_ps(_mm512_loadu_ps(w.vx + i), gx);
+		__m512 vy = _mm512_add_ps(_mm512_loadu_ps(w.vy + i), gy);
+		__m512 vz = _mm512_add_ps(_mm512_loadu_ps(w.vz + i), gz);
+		__m512 px = _mm512_add_ps(_mm512_loadu_ps(w.px + i), vx);
+		__m512 py = _mm512_add_ps(_mm512_loadu_ps(w.py + i), vy);
+		__m512 pz = _mm512_add_ps(_mm512_loadu_ps(w.pz + i), vz);
+
+		__m512 dif = _mm512_sub_ps(py, floor_y);
+		__mmask16 hit = _mm512_cmp_ps_mask(dif, _mm512_loadu_ps(w.rad + i), _CMP_LT_OQ)
+			& _mm512_cmp_ps_mask(vy, zero, _CMP_LT_OQ);
+		__m512i ids = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(w.material + i)));
+		__m512 restitution = _mm512_i32gather_ps(ids, rest, 4);
+		__m512 kept = _mm512_i32gather_ps(ids, keep, 4);
+		vy = _mm512_mask_mul_ps(vy, hit, _mm512_sub_ps(zero, vy), restitution);
+		vx = _mm512_mask_mul_ps(vx, hit, vx, kept);
+		vz = _mm512_mask_mul_ps(vz, hit, vz, kept);
+
+		_mm512_storeu_ps(w.px + i, px); _mm512_storeu_ps(w.py + i, py); _mm512_storeu_ps(w.pz + i, pz);
+		_mm512_storeu_ps(w.vx + i, vx); _mm512_storeu_ps(w.vy + i, vy); _mm512_storeu_ps(w.vz + i, vz);
+
+		unsigned mask = hit;
+		for (int lane = 0; mask != 0; lane++, mask >>= 1)
+			if (mask & 1)
+				out[hits++] = { i + lane, w.vy[i + lane] };
+	}
+
+	return hits + w.stepBodies(i, end, dt, out + hits);
+}
+
+// Runtime CPU feature checks, isa is "sse4.1", "avx" or "avx512f"
+inline bool cpuSupports(const char* isa)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	// The OS has to save the wider registers too
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool ymm = (xcr0 & 0x6) == 0x6;
+	bool zmm = (xcr0 & 0xe6) == 0xe6;
+
+	bool avx512f = false;
+	if (max_leaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx512f = (info[1] & (1 << 16)) != 0;
+	}
+
+	if (std::strcmp(isa, "sse4.1") == 0)
+		return sse41;
+	if (std::strcmp(isa, "avx") == 0)
+		return avx && ymm;
+	if (std::strcmp(isa, "avx512f") == 0)
+		return avx512f && zmm;
+	return false;
+#else
+	// Checks OS register support as well as the CPU
+	__builtin_cpu_init();
+	if (std::strcmp(isa, "sse4.1") == 0)
+		return __builtin_cpu_supports("sse4.1");
+	if (std::strcmp(isa, "avx") == 0)
+		return __builtin_cpu_supports("avx");
+	if (std::strcmp(isa, "avx512f") == 0)
+		return __builtin_cpu_supports("avx512f");
+	return false;
+#endif
+}
+
+class SSE41Kernel : public Kernel
+{
+public:
+	const char* name() const { return "sse4.1"; }
+
+	int stepRange(World &world, Real dt, int begin, int end, World::Contact *out)
+	{
+		return stepInBlocks(world, dt, begin, end, out, stepSSE41);
+	}
+};
+
+class AVXKernel : public Kernel
+{
+public:
+	const char* name() const { return "avx"; }
+
+	int stepRange(World &world, Real dt, int begin, int end, World::Contact *out)
+	{
+		return stepInBlocks(world, dt, begin, end, out, stepAVX);
+	}
+};
+
+class AVX512Kernel : public Kernel
+{
+public:
+	const char* name() const { return "avx512f"; }
+
+	int stepRange(World &world, Real dt, int begin, int end, World::Contact *out)
+	{
+		return stepInBlocks(world, dt, begin, end, out, stepAVX512);
+	}
+};
+
+#endif
+
+// Fixed set of threads that sleep between jobs, so splitting a tick does not
+// create threads or allocate
+class WorkerPool
+{
+public:
+	WorkerPool(int threads)
+	{
+		for (int i = 1; i < threads; i++)
+			workers.emplace_back(&WorkerPool::work, this, i);
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		start.notify_all();
+
+		for (std::thread &worker : workers)
+			worker.join();
+	}
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool &operator=(const WorkerPool&) = delete;
+
+	// Includes the calling thread
+	int size() const
+	{
+		return (int)workers.size() + 1;
+	}
+
+	// Runs job(context, thread index) on every thread, returns when all have finished
+	void run(void (*job)(void*, int), void *context)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			this->job = job;
+			this->context = context;
+			remaining = (int)workers.size();
+			generation++;
+		}
+		start.notify_all();
+
+		job(context, 0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&]() { return remaining == 0; });
+	}
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable start, done;
+
+	void (*job)(void*, int) = NULL;
+	void *context = NULL;
+	unsigned generation = 0;
+	int remaining = 0;
+	bool stopping = false;
+
+	void work(int index)
+	{
+		unsigned seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			start.wait(lock, [&]() { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+
+			lock.unlock();
+			job(context, index);
+			lock.lock();
+
+			if (--remaining == 0)
+				done.notify_one();
+		}
+	}
+};
+
+// Splits the bodies into one contiguous block per thread, each run by the inner kernel
+class ThreadedKernel : public Kernel
+{
+public:
+	ThreadedKernel(std::unique_ptr<Kernel> inner, int threads) :
+		inner(std::move(inner)), pool(threads), label(std::string(this->inner->name()) + "-mt" + std::to_string(threads)),
+		hits(threads)
+	{
+	}
+
+	const char* name() const { return label.c_str(); }
+
+	int stepRange(World &world, Real dt, int begin, int end, World::Contact *out)
+	{
+		Job job = { this, &world, dt, begin, end, out };
+		pool.run(&ThreadedKernel::runBlock, &job);
+
+		// Each block wrote its contacts at the start of its own range, pack them together
+		int total = 0;
+		for (int t = 0; t < pool.size(); t++)
+		{
+			int block_begin = blockStart(begin, end, t);
+			if (total != block_begin - begin)
+				std::memmove(out + total, out + (block_begin - begin), hits[t] * sizeof(World::Contact));
+			total += hits[t];
+		}
+		return total;
+	}
+
+private:
+	struct Job
+	{
+		ThreadedKernel *kernel;
+		World *world;
+		Real dt;
+		int begin, end;
+		World::Contact *out;
+	};
+
+	std::unique_ptr<Kernel> inner;
+	WorkerPool pool;
+	std::string label;
+	std::vector<int> hits; // Contacts found by each thread
+
+	// Blocks are rounded to 16 bodies so SIMD kernels only run the scalar tail at the very end
+	int blockStart(int begin, int end, int t) const
+	{
+		int count = end - begin;
+		int per_thread = ((count + pool.size() - 1) / pool.size() + 15) / 16 * 16;
+		int start = begin + per_thread * t;
+		return start < end ? start : end;
+	}
+
+	static void runBlock(void *context, int t)
+	{
+		Job &job = *(Job*)context;
+		ThreadedKernel &self = *job.kernel;
+
+		int block_begin = self.blockStart(job.begin, job.end, t);
+		int block_end = self.blockStart(job.begin, job.end, t + 1);
+		self.hits[t] = self.inner->stepRange(*job.world, job.dt, block_begin, block_end, job.out + (block_begin - job.begin));
+	}
+};
+
+// Every kernel this CPU can run, fastest single threaded last
+inline std::vector<std::unique_ptr<Kernel>> singleThreadKernels()
+{
+	std::vector<std::unique_ptr<Kernel>> kernels;
+	kernels.emplace_back(new ScalarKernel());
+#ifdef PHYSICS_SIMD_X86
+	if (cpuSupports("sse4.1"))
+		kernels.emplace_back(new SSE41Kernel());
+	if (cpuSupports("avx"))
+		kernels.emplace_back(new AVXKernel());
+	if (cpuSupports("avx512f"))
+		kernels.emplace_back(new AVX512Kernel());
+#endif
+	return kernels;
+}
+
+// Single threaded kernels, plus a threaded version of each when threads > 1
+inline std::vector<std::unique_ptr<Kernel>> availableKernels(int threads)
+{
+	std::vector<std::unique_ptr<Kernel>> kernels = singleThreadKernels();
+
+	if (threads > 1)
+	{
+		std::vector<std::unique_ptr<Kernel>> inner = singleThreadKernels();
+		for (std::unique_ptr<Kernel> &k : inner)
+			kernels.emplace_back(new ThreadedKernel(std::move(k), threads));
+	}
+	return kernels;
+}
+
+// Look a kernel up by name, NULL if this CPU can't run it
+inline std::unique_ptr<Kernel> findKernel(const std::string &name, int threads)
+{
+	for (std::unique_ptr<Kernel> &k : availableKernels(threads))
+		if (name == k->name())
+			return std::move(k);
+	return NULL;
+}
+
+// Time every available kernel on a scratch world of the given size and keep the fastest
+inline std::unique_ptr<Kernel> autoTuneKernel(int bodies, int threads, bool verbose = false)
+{
+	World world(bodies);
+	for (int i = 0; i < bodies; i++)
+	{
+		Body body;
+		body.pos = Vec3<Real>(Real((i % 100) * 0.2f), Real((i % 37) * 0.5f), Real((i / 100) * 0.2f));
+		body.rad = Real(0.1);
+		world.addBody(body);
+	}
+
+	std::vector<std::unique_ptr<Kernel>> kernels = availableKernels(threads);
+	std::unique_ptr<Kernel> best;
+	double best_time = 0;
+
+	for (std::unique_ptr<Kernel> &k : kernels)
+	{
+		k->step(world, 1 / 60.0f); // Warm up
+
+		// Best of a few short runs, so a context switch doesn't decide it
+		double time = 0;
+		for (int run = 0; run < 5; run++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			for (int tick = 0; tick < 4; tick++)
+				k->step(world, 1 / 60.0f);
+			double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (run == 0 || t < time)
+				time = t;
+		}
+
+		if (verbose)
+			std::cout << "Kernel " << k->name() << ": " << time * 1e9 / (4.0 * bodies) << " ns/body/tick" << std::endl;
+
+		if (!best || time < best_time)
+		{
+			best = std::move(k);
+			best_time = time;
+		}
+	}
+
+	if (verbose)
+		std::cout << "Using kernel " << best->name() << std::endl;
+	return best;
+}
+
+#endif
@@ -1,5 +1,9 @@
 #include <iostream>
 #include <thread>
+#include <chrono>
+#include <memory>
+#include <cstring>
+#include <cstdlib>
 
 // Window/OpenGL Functionality
 // GLAD - https://github.com/Dav1dde/glad
@@ -14,12 +18,21 @@
 
 #include "model.h"
 #include "shader.h"
+#include "physics.h"
+#include "kernels.h"
+#include "culling.h"
+#include "exporter.h"
+#include "batch.h"
+#include "timestep.h"
+#include "capture.h"
 
 // Prototypes
 void framebufferSizeCallback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window, float deltaTime);
 void cursor_callback(GLFWwindow* window, double xpos, double ypos);
-void physics(Model &ball, Model floor, float timestep);
+void physics(World &world, Kernel &kernel, Model &ball, const Model &floor, float timestep);
+void materialControls(World &world);
+void fieldControls(World &world);
 
 // Misc Variables
 const unsigned int SCR_WIDTH = 1920;
@@ -46,24 +59,88 @@ bool isRunning = true;
 
 float set_pos[3];
 float set_vel[3];
-glm::vec3 gravity(0, -0.0098, 0 );
-float restitution = 1.0;
+int ball_material = 0; // Index into the world's material table
 
 int fps = 60;
 int physics_tick = 60;
+uint64_t tick = 0; // Physics ticks run so far
 
 
 int main(int argc, char *argv[])
 {
-	// Create window with an OpenGL context
-	glfwInit();
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	// Usage: [--record <file> [--record-every N]] to save body state each tick
+	//        [--offscreen <dir> [--frames N] [--raw] [--context egl|osmesa]] to render to files without a visible window
+	std::string record_file;
+	int record_every = 1;
+	std::string offscreen_dir;
+	int offscreen_frames = 600;
+	FrameCapture::Format capture_format = FrameCapture::PPM;
+	std::string context_api;
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			record_file = argv[++i];
+		else if (std::strcmp(argv[i], "--record-every") == 0 && i + 1 < argc)
+			record_every = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--offscreen") == 0 && i + 1 < argc)
+			offscreen_dir = argv[++i];
+		else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			offscreen_frames = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--raw") == 0)
+			capture_format = FrameCapture::RAW;
+		else if (std::strcmp(argv[i], "--context") == 0 && i + 1 < argc)
+			context_api = argv[++i];
+		else
+		{
+			std::cout << "Unknown argument: " << argv[i] << std::endl;
+			return -1;
+		}
+	}
+
+	bool offscreen = !offscreen_dir.empty();
+	bool headless = offscreen && !context_api.empty();
+
+	// A headless context needs GLFW's null platform, otherwise glfwInit wants an X11 or Wayland display
+	if (headless)
+	{
+#if GLFW_VERSION_MAJOR > 3 || (GLFW_VERSION_MAJOR == 3 && GLFW_VERSION_MINOR >= 4)
+		glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#else
+		std::cout << "--context needs GLFW 3.4 to run without a display, using the display's platform" << std::endl;
+#endif
+	}
+
+	// Create window with an OpenGL context, 4.3 for multi-draw indirect if the driver has it
+	if (!glfwInit())
+	{
+		std::cout << "GLFW Initialisation Failed." << (headless ? "" : " Without a display use --offscreen with --context egl or osmesa, or run under Xvfb.") << std::endl;
+		return -1;
+	}
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+	// Offscreen renders into a framebuffer, the window is only there to own the context.
+	// On the null platform EGL (surfaceless) or OSMesa contexts need no display server,
+	// e.g. Mesa llvmpipe on a render farm.
+	if (offscreen)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		if (context_api == "egl")
+			glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+		else if (context_api == "osmesa")
+			glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+	}
+
 
 	GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "Assessment 2", NULL, NULL);
 	if (window == NULL)
+	{
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "Assessment 2", NULL, NULL);
+	}
+	if (window == NULL)
 	{
 		std::cout << "Window Initialistion Failed." << std::endl;
 		glfwTerminate();
@@ -86,26 +163,85 @@ int main(int argc, char *argv[])
 	// OpenGL Settings
 	glEnable(GL_DEPTH_TEST);
 
+	std::unique_ptr<FrameCapture> capture;
+	if (offscreen)
+	{
+		capture.reset(new FrameCapture(SCR_WIDTH, SCR_HEIGHT, offscreen_dir, capture_format));
+		isFocused = false;
+	}
+
 
 	// Load Ball
 	Model ball("Models/ball.obj");
 	Shader shader("Shaders/VertexShader", "Shaders/BasicFragShader");
+	shader.watch(); // Recompile when the shader files are edited
 
 	// Move ball away from camera a bit
 	ball.move(glm::vec3(0, 0, -4));
 
+	// Lower detail balls for when it only covers a few pixels
+	Model ball_lod1(ball.rad, 12, 24);
+	Model ball_lod2(ball.rad, 6, 12);
+	Model *ball_lods[] = { &ball, &ball_lod1, &ball_lod2 };
+
 	// Load Floor
 	Model floor("Models/floor.obj");
 
 	// Move floor down and away
 	floor.move(glm::vec3(0, -4, -4));
 
+	// All meshes share one vertex buffer, drawn together once a frame
+	MeshBuffer meshes;
+	for (Model *mesh : ball_lods)
+		meshes.add(*mesh);
+	meshes.add(floor);
+	meshes.upload();
+
+	// Multi-draw needs the model matrix per instance rather than as a uniform
+	std::unique_ptr<Shader> batch_shader;
+	if (DrawBatch::indirectAvailable())
+	{
+		batch_shader.reset(new Shader("Shaders/BatchVertexShader", "Shaders/BasicFragShader"));
+		if (batch_shader->ID == 0)
+			batch_shader.reset();
+		else
+			batch_shader->watch();
+	}
+	Shader &scene_shader = batch_shader ? *batch_shader : shader;
+	DrawBatch batch(meshes, 64, batch_shader != NULL);
+
+	// Ball is the only body in the physics world. The world holds its state
+	// at full precision, the model only gets a copy to draw.
+	World world(1);
+	{
+		Body body;
+		body.pos = Vec3<Real>(ball.pos);
+		body.velocity = Vec3<Real>(ball.velocity);
+		body.rad = Real(ball.rad);
+		world.addBody(body);
+	}
+	world.params.gravity = Vec3<Real>(glm::vec3(0, -0.0098, 0));
+	world.params.floor_y = Real(floor.pos.y);
+
+	// Stepping backend, probed and timed once for this CPU and world size
+	std::unique_ptr<Kernel> kernel = autoTuneKernel(world.capacity, (int)std::thread::hardware_concurrency(), true);
+
+	std::unique_ptr<TrajectoryWriter> recorder;
+	if (!record_file.empty())
+		recorder.reset(new TrajectoryWriter(record_file, world.capacity, record_every));
+
 	// Setup matrices
 	glm::mat4 projection;
 	projection = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
 	glm::mat4 view;
 	view = glm::lookAt(camera.position, camera.position + camera.front, camera.orientation);
 
+	// Culling and LOD settings, frustum is updated each frame
+	CullParams cull;
+	cull.pixel_scale = lodPixelScale(projection, SCR_HEIGHT);
+	cull.lod_pixels[0] = 64; // Full detail above this diameter
+	cull.lod_pixels[1] = 16;
+
 	// Initialise GUI Lib
 	IMGUI_CHECKVERSION();
 	ImGui::CreateContext();
@@ -121,7 +257,7 @@ int main(int argc, char *argv[])
 
 	float frame_time = 1 / (float)fps;
 	float physics_time = 1 / (float)physics_tick;
-	float time_buffer = 0.0;
+	TimestepController timestep(physics_time, frame_time); // Caps catch up so a slow tick can't lock up the app
 
 	// Render Loop
 	while (!glfwWindowShouldClose(window))
@@ -132,50 +268,79 @@ int main(int argc, char *argv[])
 
 		
 		// FPS Control
-		frame_time = 1 / (float)fps;
-		if (delta_time < frame_time)
+		if (frame_time != 1 / (float)fps)
+		{
+			frame_time = 1 / (float)fps;
+			timestep.setFrameTime(frame_time);
+		}
+		if (offscreen)
+			delta_time = frame_time; // Fixed steps, as fast as it can render
+		else if (delta_time < frame_time)
 		{
 			float new_time = frame_time - delta_time;
 			delta_time = frame_time;
-			Sleep(new_time * 1000);
+			std::this_thread::sleep_for(std::chrono::duration<float>(new_time));
 		}
 
-		time_buffer += delta_time;
-		while(time_buffer >= physics_time) // Phyiscs updates at own rate
+		timestep.run(delta_time, [&]() // Phyiscs updates at own rate
 		{
-			physics(ball, floor, physics_time);
-			time_buffer -= physics_time;
-		}
+			physics(world, *kernel, ball, floor, physics_time);
+
+			if (isRunning)
+			{
+				if (recorder)
+					recorder->record(world, tick);
+				tick++;
+			}
+		});
 		
-		processInput(window, delta_time);
+		if (!offscreen)
+			processInput(window, delta_time);
 
 
 		// Update view position
 		view = glm::lookAt(camera.position, camera.position + camera.front, camera.orientation);
 
+		if (capture)
+			capture->bind();
+
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		shader.use();
-		shader.setMat4("projection", projection);
-		shader.setMat4("view", view);
+		scene_shader.reload();
+		scene_shader.use();
+		scene_shader.setMat4("projection", projection);
+		scene_shader.setMat4("view", view);
 
 		// Pass uniform
-		shader.setVec3("colour", glm::vec3(1.0, 0.0, 0.0));
-		shader.setVec3("lightPosition", camera.position);
+		scene_shader.setVec3("lightPosition", camera.position);
+		batch.clear();
+
+		// Skip the ball when off screen, otherwise pick a mesh by its size on screen
+		cull.frustum = extractFrustum(projection * view);
+		cull.eye = camera.position;
+		signed char ball_lod;
+		cullBodies(cull, &ball.pos.x, &ball.pos.y, &ball.pos.z, &ball.rad, 1, &ball_lod);
 
 		// Draw Ball
-		shader.setMat4("model", ball.position);
-		glBindVertexArray(ball.vao);
-		glDrawArrays(GL_TRIANGLES, 0, ball.vertex.size());
-		glBindVertexArray(0);
+		if (ball_lod >= 0)
+			batch.add(*ball_lods[ball_lod], ball.position, glm::vec3(1.0, 0.0, 0.0));
 
 		// Draw Floor
-		shader.setMat4("model", floor.position);
-		shader.setVec3("colour", glm::vec3(0.0, 1.0, 0.0));
-		glBindVertexArray(floor.vao);
-		glDrawArrays(GL_TRIANGLES, 0, floor.vertex.size());
-		glBindVertexArray(0);
+		batch.add(floor, floor.position, glm::vec3(0.0, 1.0, 0.0));
+
+		batch.draw(scene_shader);
+
+		// No GUI in the saved frames
+		if (capture)
+		{
+			capture->capture();
+			if (capture->framesCaptured() >= offscreen_frames)
+				glfwSetWindowShouldClose(window, true);
+
+			glfwPollEvents();
+			continue;
+		}
 
 		// Draw GUI
 		ImGui_ImplOpenGL3_NewFrame();
@@ -190,12 +355,23 @@ int main(int argc, char *argv[])
 		ImGui::InputFloat3("Position", set_pos);
 		ImGui::InputFloat3("Velocity", set_vel);
 		if (ImGui::Button("Set"))
+		{
 			ball.setState(set_pos, set_vel);
 
-		ImGui::SliderFloat("Restitution", &restitution, 0.0, 1.0);
-		ImGui::SliderFloat("Gravity", &gravity.y, 0.0, -0.01);
+			Body body = world.getBody(0);
+			body.pos = Vec3<Real>(ball.pos);
+			body.velocity = Vec3<Real>(ball.velocity);
+			world.setBody(0, body);
+		}
+
+		float gravity = float(world.params.gravity.y);
+		if (ImGui::SliderFloat("Gravity", &gravity, 0.0, -0.01))
+			world.params.gravity.y = Real(gravity);
 		ImGui::SliderInt("FPS", &fps, 1, 59);
 
+		materialControls(world);
+		fieldControls(world);
+
 		if (isRunning)
 		{
 			if (ImGui::Button("Pause"))
@@ -207,6 +383,13 @@ int main(int argc, char *argv[])
 				isRunning = true;
 		}
 
+		ImGui::Text("Sim speed: %.0f%%  Tick: %.2f ms", timestep.simSpeed() * 100, timestep.tickCost() * 1000);
+		if (timestep.isBehind())
+			ImGui::TextColored(ImVec4(1, 0.4f, 0.4f, 1), "Behind real time, %.1f s dropped", timestep.droppedTime());
+
+		if (recorder)
+			ImGui::Text("Recording: %llu samples, %llu dropped", (unsigned long long)recorder->samplesRecorded(), (unsigned long long)recorder->samplesDropped());
+
 		if(ImGui::Button("Close"))
 			glfwSetWindowShouldClose(window, true);
 
@@ -220,6 +403,9 @@ int main(int argc, char *argv[])
 		glfwPollEvents();
 	}
 	
+	// Write out frames still in flight
+	capture.reset();
+
 	// Destroy GUI
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
@@ -233,34 +419,113 @@ void framebufferSizeCallback(GLFWwindow* window, int width, int height)
 	glViewport(0, 0, width, height);
 }
 
-void physics(Model &ball, Model floor, float timestep)
+void physics(World &world, Kernel &kernel, Model &ball, const Model &floor, float timestep)
 {
 	if (isRunning)
 	{
 		// Gravity
-		glm::vec3 g(gravity * timestep);
-		ball.velocity = ball.velocity + (gravity * timestep); // Add gravity to balls velocity
-		ball.move(ball.velocity); // Apply velocity to ball
+		glm::vec3 g(world.params.gravity.toGlm() * timestep);
+		bool bounced = kernel.step(world, timestep) > 0;
+		Body body = world.getBody(0);
+
+		// Copy for drawing only, never read back into the world
+		ball.setPosition(body.pos.toGlm());
+		ball.velocity = body.velocity.toGlm();
 
 		std::cout << "\n\t== Gravity ==\n";
 		std::cout << "FPS: " << fps << "    |    Timestep: " << timestep << "    |    Change in y: " << g.y  << ")\n\t==============";
 
-		// Collision
-		glm::vec3 dif = ball.pos - floor.pos; // Distance between ball centre and floor
-
 		//Rebound
-		if(dif.y < ball.rad & ball.velocity.y < 0) // If distance to floor less than radius and object is movign towards it
+		if (bounced && ball.velocity.y > 0.001) // Debug info
 		{
-			ball.velocity.y = -ball.velocity.y * restitution;
+			std::cout << "\n\tCollision" << std::endl;
+			std::cout << "Radius: " << ball.rad << "    |    Dist to Floor: " << ball.pos.y - floor.pos.y << std::endl;
+			std::cout << "Restitution: " << float(world.contactRestitution()[ball_material]) << "   |   Velocity: " << ball.velocity.y << std::endl;
+		}
+	}
+}
 
-			if (ball.velocity.y > 0.001) // Debug info
-			{
-				std::cout << "\n\tCollision" << std::endl;
-				std::cout << "Radius: " << ball.rad << "    |    Dist to Floor: " << dif.y << std::endl;
-				std::cout << "Restitution: " << restitution << "   |   Velocity: " << ball.velocity.y << std::endl;
-			}
+// Edit the material table, the floor and which material the ball uses
+void materialControls(World &world)
+{
+	if (!ImGui::CollapsingHeader("Materials"))
+		return;
+
+	for (int id = 0; id <= world.materialCount(); id++)
+	{
+		// Last row is the floor
+		bool is_floor = id == world.materialCount();
+		Material m = is_floor ? world.getFloorMaterial() : world.getMaterial(id);
+		float values[3] = { float(m.restitution), float(m.friction), float(m.density) };
+
+		ImGui::PushID(id);
+		if (is_floor)
+			ImGui::Text("Floor");
+		else
+		{
+			// Ball is body 0
+			if (ImGui::RadioButton("Ball", &ball_material, id))
+				world.material[0] = (uint8_t)id;
+		}
+
+		bool changed = ImGui::SliderFloat("Restitution", &values[0], 0.0, 1.0);
+		changed |= ImGui::SliderFloat("Friction", &values[1], 0.0, 1.0);
+		if (!is_floor)
+			changed |= ImGui::SliderFloat("Density", &values[2], 0.1, 10.0);
+		ImGui::PopID();
+
+		if (changed)
+		{
+			m.restitution = Real(values[0]);
+			m.friction = Real(values[1]);
+			m.density = Real(values[2]);
+			if (is_floor)
+				world.setFloorMaterial(m);
+			else
+				world.setMaterial(id, m);
 		}
 	}
+
+	if (ImGui::Button("Add material") && world.addMaterial(Material()) < 0)
+		std::cout << "Material table is full" << std::endl;
+}
+
+// Edit the boxes that add gravity or force on top of the world's gravity
+void fieldControls(World &world)
+{
+	if (!ImGui::CollapsingHeader("Force fields"))
+		return;
+
+	for (int i = 0; i < world.fieldCount(); i++)
+	{
+		ForceField &field = world.getField(i);
+		Vec3<Real> *vectors[4] = { &field.min, &field.max, &field.acceleration, &field.force };
+		const char *labels[4] = { "Min", "Max", "Acceleration", "Force" };
+
+		ImGui::PushID(i);
+		ImGui::Text("Field %d", i);
+		for (int v = 0; v < 4; v++)
+		{
+			glm::vec3 value = vectors[v]->toGlm();
+			if (ImGui::InputFloat3(labels[v], &value.x))
+				*vectors[v] = Vec3<Real>(value);
+		}
+		bool remove = ImGui::Button("Remove");
+		ImGui::PopID();
+
+		// Last field moves into this slot, so look at it again
+		if (remove)
+			world.removeField(i--);
+	}
+
+	if (ImGui::Button("Add field"))
+	{
+		ForceField field;
+		field.min = Vec3<Real>(glm::vec3(-1, -1, -1));
+		field.max = Vec3<Real>(glm::vec3(1, 1, 1));
+		if (world.addField(field) < 0)
+			std::cout << "Too many force fields" << std::endl;
+	}
 }
 
 void processInput(GLFWwindow *window, float deltaTime)
@@ -1,3 +1,6 @@
+#ifndef MODEL_H
+#define MODEL_H
+
 // GL Math Library - https://github.com/g-truc/glm
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -25,7 +28,9 @@ struct Model
 	std::vector<int> texture_indices;
 	std::vector<int> normal_indices;
 
-	unsigned int vao, vbo, ebo;
+	// Where the mesh sits in the shared vertex buffer, set by MeshBuffer::add
+	int first = 0;
+	int count = 0;
 
 	// Physics Data
 	glm::vec3 velocity = { 0, 0, 0 };
@@ -36,29 +41,55 @@ struct Model
 
 	Model()	{}
 
+	// Vertex data goes to the GPU through MeshBuffer
 	Model(std::string filename)
 	{
 		loadModel(filename);
+	}
+
+	// Generated sphere, used for the lower detail versions of a loaded ball
+	Model(float radius, int rings, int segments)
+	{
+		buildSphere(radius, rings, segments);
+	}
+
+	void buildSphere(float radius, int rings, int segments)
+	{
+		const float pi = 3.14159265f;
 
-		glGenVertexArrays(1, &vao);
-		glGenBuffers(1, &vbo);
-		glGenBuffers(1, &ebo);
+		// Point on the sphere at ring r (top to bottom) and segment s (around)
+		auto point = [&](int r, int s)
+		{
+			Vertex v;
+			float theta = pi * r / rings;
+			float phi = 2 * pi * s / segments;
 
-		glBindVertexArray(vao);
+			v.normals[0] = sin(theta) * cos(phi);
+			v.normals[1] = cos(theta);
+			v.normals[2] = sin(theta) * sin(phi);
 
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, vertex.size() * (6 * sizeof(float)), vertex.data(), GL_STATIC_DRAW);
+			for (int i = 0; i < 3; i++)
+				v.vertex[i] = v.normals[i] * radius;
 
-		//glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-		//glBufferData(GL_ELEMENT_ARRAY_BUFFER, faces.size() * sizeof(int), faces.data(), GL_STATIC_DRAW);
+			return v;
+		};
 
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-		glEnableVertexAttribArray(0);
+		// Two triangles per quad, wound counter clockwise from outside
+		for (int r = 0; r < rings; r++)
+		{
+			for (int s = 0; s < segments; s++)
+			{
+				vertex.push_back(point(r, s));
+				vertex.push_back(point(r + 1, s + 1));
+				vertex.push_back(point(r + 1, s));
 
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-		glEnableVertexAttribArray(1);
+				vertex.push_back(point(r, s));
+				vertex.push_back(point(r, s + 1));
+				vertex.push_back(point(r + 1, s + 1));
+			}
+		}
 
-		glBindVertexArray(0);
+		rad = radius;
 	}
 
 	void move(glm::vec3 trans)
@@ -67,6 +98,13 @@ struct Model
 		pos = pos + trans;
 	}
 
+	// Rebuild the matrix from the position rather than adding to it, so the two can't drift apart
+	void setPosition(glm::vec3 p)
+	{
+		position = glm::translate(glm::mat4(), p);
+		pos = p;
+	}
+
 	// Used to set the state of the ball
 	void setState(float trans[3], float vel[3])
 	{
@@ -361,4 +399,6 @@ Model loadModel(std::string filename)
 
 
 	return m;
-}
\ No newline at end of file
+}
+
+#endif
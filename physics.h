@@ -0,0 +1,475 @@
+#ifndef PHYSICS_H
+#define PHYSICS_H
+
+// GL Math Library - https://github.com/g-truc/glm
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <cmath>
+#include <cstdint>
+
+#include "arena.h"
+#include "fixed.h"
+
+// Physics core shared by the viewer and the headless tools.
+// Nothing in here touches OpenGL so it can run without a window.
+
+// Scalar type for the physics core, picked at compile time.
+// float by default, PHYSICS_REAL_DOUBLE for double or PHYSICS_REAL_FIXED for
+// 32.32 fixed point which gives identical results on every machine.
+#if defined(PHYSICS_REAL_DOUBLE)
+typedef double Real;
+#define PHYSICS_REAL_NAME "double"
+#elif defined(PHYSICS_REAL_FIXED)
+typedef Fixed Real;
+#define PHYSICS_REAL_NAME "fixed"
+#else
+typedef float Real;
+#define PHYSICS_REAL_NAME "float"
+#define PHYSICS_REAL_FLOAT
+#endif
+
+// Minimal vector so the core works with any scalar type, glm only takes floating point
+template<typename T>
+struct Vec3
+{
+	T x, y, z;
+
+	Vec3() : x(0), y(0), z(0) {}
+	Vec3(T x, T y, T z) : x(x), y(y), z(z) {}
+	explicit Vec3(const glm::vec3 &v) : x(T(v.x)), y(T(v.y)), z(T(v.z)) {}
+
+	glm::vec3 toGlm() const
+	{
+		return glm::vec3((float)x, (float)y, (float)z);
+	}
+
+	Vec3 operator+(const Vec3 &o) const { return Vec3(x + o.x, y + o.y, z + o.z); }
+	Vec3 operator-(const Vec3 &o) const { return Vec3(x - o.x, y - o.y, z - o.z); }
+	Vec3 operator*(T s) const { return Vec3(x * s, y * s, z * s); }
+};
+
+// Shared by every body in a World, bounce and friction come from its material table
+template<typename T>
+struct BasicSimParams
+{
+	Vec3<T> gravity = Vec3<T>(T(0), T(-0.0098), T(0));
+	T floor_y = T(-4.0); // Height of the floor plane
+};
+
+// Stepping a lone body outside a World, with its bounce given directly
+template<typename T>
+struct BasicBodyParams : BasicSimParams<T>
+{
+	T restitution = T(1.0);
+};
+
+template<typename T>
+struct BasicBody
+{
+	Vec3<T> pos;
+	Vec3<T> velocity;
+	T rad = T(1.0); // radius (for spheres)
+	uint8_t material = 0; // Index into the world's material table
+};
+
+// Surface and bulk properties shared by every body with the same material id
+template<typename T>
+struct BasicMaterial
+{
+	T restitution = T(1.0);
+	T friction = T(0.0); // Fraction of sideways velocity lost on contact
+	T density = T(1.0);
+};
+
+// Two materials combined for a contact, looked up rather than worked out each tick
+template<typename T>
+struct BasicContactMaterial
+{
+	T restitution = T(1.0);
+	T keep = T(1.0); // Sideways velocity kept after friction
+};
+
+// Extra gravity and force applied to bodies inside a box.
+// Force is per unit volume, so it accelerates light materials more than dense ones.
+template<typename T>
+struct BasicForceField
+{
+	Vec3<T> min, max;
+	Vec3<T> acceleration;
+	Vec3<T> force;
+};
+
+typedef BasicSimParams<Real> SimParams;
+typedef BasicBodyParams<Real> BodyParams;
+typedef BasicBody<Real> Body;
+typedef BasicMaterial<Real> Material;
+typedef BasicForceField<Real> ForceField;
+
+// Advance a body by one physics tick, returns true if it bounced off the floor.
+// One operation per statement so the order is fixed, build with
+// PHYSICS_STRICT_FP so the compiler does not fuse them either.
+template<typename T>
+inline bool stepBody(BasicBody<T> &body, const BasicSimParams<T> &params, T timestep, const BasicContactMaterial<T> &contact)
+{
+	// Gravity
+	body.velocity = body.velocity + (params.gravity * timestep); // Add gravity to velocity
+	body.pos = body.pos + body.velocity; // Apply velocity to body
+
+	// Collision
+	T dif = body.pos.y - params.floor_y; // Distance between body centre and floor
+
+	// Rebound
+	if (dif < body.rad && body.velocity.y < T(0)) // If distance to floor less than radius and object is moving towards it
+	{
+		body.velocity.y = -body.velocity.y * contact.restitution;
+		body.velocity.x = body.velocity.x * contact.keep;
+		body.velocity.z = body.velocity.z * contact.keep;
+		return true;
+	}
+
+	return false;
+}
+
+// Lone body using the restitution in params and no friction
+template<typename T>
+inline bool stepBody(BasicBody<T> &body, const BasicBodyParams<T> &params, T timestep)
+{
+	BasicContactMaterial<T> contact;
+	contact.restitution = params.restitution;
+	return stepBody(body, params, timestep, contact);
+}
+
+// Floor contact recorded during a tick
+template<typename T>
+struct BasicContact
+{
+	int body;
+	T speed; // Rebound speed
+};
+
+// Many bodies sharing one set of parameters.
+// Body state is kept per component so a step runs down contiguous arrays.
+// Storage for every body is allocated once at construction and contacts
+// live in a per-tick arena, so step() does no heap allocation.
+//
+// Each body has a material id indexing a small table. The table is folded
+// against the floor material into per id contact values whenever it
+// changes, so the step only does an indexed load per body.
+template<typename T>
+struct BasicWorld
+{
+	typedef BasicBody<T> Body;
+	typedef BasicContact<T> Contact;
+	typedef BasicMaterial<T> Material;
+	typedef BasicForceField<T> ForceField;
+
+	static const int MAX_MATERIALS = 256;
+	static const int MAX_FIELDS = 16;
+	static const int FIELD_BLOCK = 1024; // Bodies given their fields at a time before stepping them
+
+	BasicSimParams<T> params;
+
+	T *px, *py, *pz;
+	T *vx, *vy, *vz;
+	T *rad;
+	uint8_t *material;
+
+	int count = 0;
+	int capacity;
+
+	// Contacts from the last step, valid until the next one
+	Contact *contacts = NULL;
+	int contact_count = 0;
+
+	BasicWorld(int capacity) :
+		capacity(capacity),
+		storage(new T[columnStride(capacity) * 7]),
+		material_storage(new uint8_t[(size_t)capacity + 64]()),
+		arena(capacity * sizeof(Contact) + alignof(Contact))
+	{
+		material = material_storage.get();
+
+		// Material 0 is the default every body starts with
+		materials[0] = Material();
+		material_count = 1;
+
+		size_t stride = columnStride(capacity);
+		T *columns[] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+		for (int i = 0; i < 7; i++)
+			columns[i] = storage.get() + stride * i;
+
+		px = columns[0]; py = columns[1]; pz = columns[2];
+		vx = columns[3]; vy = columns[4]; vz = columns[5];
+		rad = columns[6];
+	}
+
+	BasicWorld(const BasicWorld&) = delete;
+	BasicWorld &operator=(const BasicWorld&) = delete;
+
+	// Returns the body index, or -1 when the world is full
+	int addBody(const Body &body)
+	{
+		if (count == capacity)
+			return -1;
+
+		setBody(count, body);
+		return count++;
+	}
+
+	// Swaps the last body into the freed slot
+	void removeBody(int i)
+	{
+		count--;
+		if (i != count)
+			setBody(i, getBody(count));
+	}
+
+	Body getBody(int i) const
+	{
+		Body body;
+		body.pos = Vec3<T>(px[i], py[i], pz[i]);
+		body.velocity = Vec3<T>(vx[i], vy[i], vz[i]);
+		body.rad = rad[i];
+		body.material = material[i];
+		return body;
+	}
+
+	void setBody(int i, const Body &body)
+	{
+		px[i] = body.pos.x; py[i] = body.pos.y; pz[i] = body.pos.z;
+		vx[i] = body.velocity.x; vy[i] = body.velocity.y; vz[i] = body.velocity.z;
+		rad[i] = body.rad;
+		material[i] = body.material;
+	}
+
+	// Returns the new material id, or -1 when the table is full
+	int addMaterial(const Material &m)
+	{
+		if (material_count == MAX_MATERIALS)
+			return -1;
+
+		materials[material_count] = m;
+		materials_changed = true;
+		return material_count++;
+	}
+
+	const Material &getMaterial(int id) const
+	{
+		return materials[id];
+	}
+
+	void setMaterial(int id, const Material &m)
+	{
+		materials[id] = m;
+		materials_changed = true;
+	}
+
+	int materialCount() const
+	{
+		return material_count;
+	}
+
+	const Material &getFloorMaterial() const
+	{
+		return floor_material;
+	}
+
+	void setFloorMaterial(const Material &m)
+	{
+		floor_material = m;
+		materials_changed = true;
+	}
+
+	// Returns the field index, or -1 when there are already MAX_FIELDS
+	int addField(const ForceField &field)
+	{
+		if (field_count == MAX_FIELDS)
+			return -1;
+
+		fields[field_count] = field;
+		return field_count++;
+	}
+
+	void removeField(int i)
+	{
+		field_count--;
+		if (i != field_count)
+			fields[i] = fields[field_count];
+	}
+
+	ForceField &getField(int i)
+	{
+		return fields[i];
+	}
+
+	int fieldCount() const
+	{
+		return field_count;
+	}
+
+	// Body material combined with the floor, indexed by material id
+	const T* contactRestitution() const
+	{
+		return contact_restitution;
+	}
+
+	const T* contactKeep() const
+	{
+		return contact_keep;
+	}
+
+	// Step every body, returns the number of floor contacts this tick
+	int step(float timestep)
+	{
+		beginStep(T(timestep));
+		contact_count = stepRange(0, count, T(timestep), contacts);
+		return contact_count;
+	}
+
+	// Clear last tick's data so contacts has room for every body, then
+	// bring the contact tables up to date and work out each field's change
+	// in velocity per material. Bodies are only touched by stepRange.
+	void beginStep(T dt)
+	{
+		arena.reset();
+		contacts = arena.alloc<Contact>(count);
+		contact_count = 0;
+
+		if (materials_changed)
+			updateContactTable();
+
+		for (int f = 0; f < field_count; f++)
+			prepareField(f, dt);
+	}
+
+	// Step bodies [begin, end), writes their contacts to out and returns how many.
+	// Fields and the step run a block at a time so bodies are still in cache for the second pass.
+	int stepRange(int begin, int end, T dt, Contact *out)
+	{
+		int hits = 0;
+		for (int b = begin; b < end; b += FIELD_BLOCK)
+		{
+			int e = b + FIELD_BLOCK < end ? b + FIELD_BLOCK : end;
+			applyFields(b, e);
+			hits += stepBodies(b, e, dt, out + hits);
+		}
+		return hits;
+	}
+
+	// Force fields for bodies [begin, end), the first part of stepRange
+	void applyFields(int begin, int end)
+	{
+		for (int f = 0; f < field_count; f++)
+		{
+			addInside(end - begin, px + begin, py + begin, pz + begin, vx + begin, vy + begin, vz + begin, material + begin,
+				field_dx[f], field_dy[f], field_dz[f], fields[f].min, fields[f].max);
+		}
+	}
+
+	// The rest of stepRange, gravity, movement and floor contacts
+	int stepBodies(int begin, int end, T dt, Contact *out)
+	{
+		int hits = 0;
+		for (int i = begin; i < end; i++)
+		{
+			Body body = getBody(i);
+			BasicContactMaterial<T> contact;
+			contact.restitution = contact_restitution[body.material];
+			contact.keep = contact_keep[body.material];
+
+			if (stepBody(body, params, dt, contact))
+				out[hits++] = { i, body.velocity.y };
+			setBody(i, body);
+		}
+		return hits;
+	}
+
+private:
+	std::unique_ptr<T[]> storage;
+	std::unique_ptr<uint8_t[]> material_storage; // Padded so SIMD loads past the last body stay in bounds
+	Arena arena;
+
+	Material materials[MAX_MATERIALS];
+	int material_count = 0;
+	Material floor_material;
+	bool materials_changed = true;
+
+	T contact_restitution[MAX_MATERIALS];
+	T contact_keep[MAX_MATERIALS];
+	T inv_density[MAX_MATERIALS];
+	T field_dx[MAX_FIELDS][MAX_MATERIALS]; // Change in velocity per field and material this tick
+	T field_dy[MAX_FIELDS][MAX_MATERIALS];
+	T field_dz[MAX_FIELDS][MAX_MATERIALS];
+
+	ForceField fields[MAX_FIELDS];
+	int field_count = 0;
+
+	// Restitution multiplies, friction is the geometric mean.
+	// Worked out in double so the table is the same whatever T is.
+	void updateContactTable()
+	{
+		double floor_restitution = (double)floor_material.restitution;
+		double floor_friction = (double)floor_material.friction;
+
+		for (int id = 0; id < MAX_MATERIALS; id++)
+		{
+			const Material &m = materials[id];
+			double friction = std::sqrt((double)m.friction * floor_friction);
+			contact_restitution[id] = T((double)m.restitution * floor_restitution);
+			contact_keep[id] = T(1.0 - friction);
+			inv_density[id] = T((double)m.density > 0 ? 1.0 / (double)m.density : 0.0);
+		}
+		materials_changed = false;
+	}
+
+	// The change in velocity for each material is worked out once a tick,
+	// so the pass over the bodies only looks it up. Covers every id, like the
+	// contact table, so a body given an id that was never added still reads
+	// defined values.
+	void prepareField(int f, T dt)
+	{
+		const ForceField &field = fields[f];
+		for (int id = 0; id < MAX_MATERIALS; id++)
+		{
+			field_dx[f][id] = (field.acceleration.x + field.force.x * inv_density[id]) * dt;
+			field_dy[f][id] = (field.acceleration.y + field.force.y * inv_density[id]) * dt;
+			field_dz[f][id] = (field.acceleration.z + field.force.z * inv_density[id]) * dt;
+		}
+	}
+
+	// Batch pass over bodies for one field. Whether a body is inside becomes a
+	// 0 or 1 multiplier rather than a branch, so the loop vectorises.
+	// Columns never overlap, restrict parameters let the compiler vectorise without runtime overlap checks
+	static void addInside(int n, const T *__restrict x, const T *__restrict y, const T *__restrict z,
+		T *__restrict u, T *__restrict v, T *__restrict w, const uint8_t *__restrict m,
+		const T *__restrict dx, const T *__restrict dy, const T *__restrict dz, Vec3<T> lo, Vec3<T> hi)
+	{
+		T min_x = lo.x, min_y = lo.y, min_z = lo.z;
+		T max_x = hi.x, max_y = hi.y, max_z = hi.z;
+
+		for (int i = 0; i < n; i++)
+		{
+			int inside = (x[i] >= min_x) & (x[i] < max_x)
+				& (y[i] >= min_y) & (y[i] < max_y)
+				& (z[i] >= min_z) & (z[i] < max_z);
+			T scale = T(inside);
+
+			u[i] = u[i] + dx[m[i]] * scale;
+			v[i] = v[i] + dy[m[i]] * scale;
+			w[i] = w[i] + dz[m[i]] * scale;
+		}
+	}
+
+	// Keep each column starting on a 64 byte boundary relative to the block
+	static size_t columnStride(int capacity)
+	{
+		size_t per_line = 64 / sizeof(T);
+		return ((size_t)capacity + per_line - 1) / per_line * per_line;
+	}
+};
+
+typedef BasicContact<Real> Contact;
+typedef BasicWorld<Real> World;
+
+#endif
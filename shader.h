@@ -14,6 +14,23 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <iterator>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// Compiled programs are saved here and reused on later runs
+#define SHADER_CACHE_DIR "ShaderCache"
 
 // Adapted from Joey De Vries at https://learnopengl.com
 // Source: https://learnopengl.com/code_viewer_gh.php?code=includes/learnopengl/shader_s.h
@@ -23,74 +40,43 @@ class Shader
 public:
 	unsigned int ID;
 
-	Shader(const char* vertexFile, const char* fragmentFile)
+	Shader(const char* vertexFile, const char* fragmentFile) : ID(0), vertex_path(vertexFile), fragment_path(fragmentFile)
 	{
-		std::string v_code;
-		std::string f_code;
-		std::ifstream v_file;
-		std::ifstream f_file;
-
-		v_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		f_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-
 		// Read Files
-		try
-		{
-			v_file.open(vertexFile);
-			f_file.open(fragmentFile);
-			std::stringstream v_stream, f_stream;
-	
-			v_stream << v_file.rdbuf();
-			f_stream << f_file.rdbuf();
-
-			v_file.close();
-			f_file.close();
-
-			v_code = v_stream.str();
-			f_code = f_stream.str();
-		}
-		catch (std::ifstream::failure e)
+		if (!readFile(vertexFile, v_code) || !readFile(fragmentFile, f_code))
 		{
 			std::cout << "Vertex or Fragment Shader Read Failure" << std::endl;
 			std::cout << vertexFile << std::endl;
 			std::cout << fragmentFile << std::endl;
 		}
-		// Convert to c strings
-		const char* cstr_v_code = v_code.c_str();
-		const char * cstr_f_code = f_code.c_str();
 
-	
-		unsigned int vertex, fragment;
-		int success;
-		char infoLog[512];
-
-		// Compile Shaders
-
-		// Vertex Shader
-		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &cstr_v_code, NULL);
-		glCompileShader(vertex);
-		checkCompileErrors(vertex, "VERTEX");
-
-		// Fragment Shader
-		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &cstr_f_code, NULL);
-		glCompileShader(fragment);
-		checkCompileErrors(fragment, "FRAGMENT");
+		// Load from the cache or compile
+		ID = build(v_code, f_code, g_code);
+	}
 
-		// Link Shaders
-		ID = glCreateProgram();
-		glAttachShader(ID, vertex);
-		glAttachShader(ID, fragment);
+	~Shader()
+	{
+		// Stop the hot reload thread if running
+		watching = false;
+		if (watcher.joinable())
+			watcher.join();
 
-		glLinkProgram(ID);
-		checkCompileErrors(ID, "PROGRAM");
+		// Drop a reload still compiling, no need to wait for it
+		if (building.program != 0)
+		{
+			for (unsigned int shader : building.shaders)
+				if (shader != 0)
+					glDeleteShader(shader);
+			glDeleteProgram(building.program);
+		}
 
-		// Delete once finished
-		glDeleteShader(vertex);
-		glDeleteShader(fragment);
+		if (ID != 0)
+			glDeleteProgram(ID);
 	}
 
+	Shader(const Shader&) = delete;
+	Shader &operator=(const Shader&) = delete;
+
 	void use()
 	{
 		glUseProgram(ID);
@@ -144,42 +130,80 @@ public:
 	void addGeometryShader(const char* file)
 	{
 		std::cout << "Geo Shader Linking Started" << std::endl;
-		std::string geoCode;
-		std::ifstream gFile;
-		gFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		try
-		{
-			gFile.open(file);
-			std::stringstream v_stream;
-			
-			v_stream << gFile.rdbuf();
-			
-			gFile.close();
-			
-			geoCode = v_stream.str();
-		}
-		catch (std::ifstream::failure e)
+		if (!readFile(file, g_code))
 		{
 			std::cout << "Geometry Shader Failed To Read" << std::endl;
 			std::cout << file << std::endl;
 		}
+		geometry_path = file;
 
-		const char* gShaderCode = geoCode.c_str();
-		unsigned int geo;
-		int success;
-		char infoLog[512];
+		// Rebuild the whole program, the current one may have come from the cache with nothing attached
+		unsigned int program = build(v_code, f_code, g_code);
+		if (program == 0)
+			return;
 
-		geo = glCreateShader(GL_GEOMETRY_SHADER);
-		glShaderSource(geo, 1, &gShaderCode, NULL);
-		glCompileShader(geo);
-		checkCompileErrors(geo, "GEOMETRY");
+		glDeleteProgram(ID);
+		ID = program;
+		std::cout << "Geometry Shader Successfully Added" << std::endl;
+	}
 
-		glAttachShader(ID, geo);
-		glLinkProgram(ID);
-		checkCompileErrors(ID, "PROGRAM");
+	// Start watching the source files, changes are picked up by reload().
+	// Call after any addGeometryShader so the geometry file is watched too.
+	void watch()
+	{
+		if (watching)
+			return;
 
-		glDeleteShader(geo);
-		std::cout << "Geometry Shader Successfully Added" << std::endl;
+		// Let the driver compile on its own threads so reload() never waits on it
+#ifdef GL_KHR_parallel_shader_compile
+		if (GLAD_GL_KHR_parallel_shader_compile)
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+#endif
+
+		watching = true;
+		watcher = std::thread(&Shader::watchFiles, this);
+	}
+
+	// Call once a frame on the GL thread. Files are read on the watcher thread
+	// and this only starts the compile. With KHR_parallel_shader_compile later
+	// frames poll until the driver has finished and the new program is swapped
+	// in then, without it the compile completes in the frame that starts it.
+	// Keeps the old program if the new one fails.
+	bool reload()
+	{
+		if (building.program == 0)
+		{
+			if (!pending)
+				return false;
+
+			{
+				std::lock_guard<std::mutex> lock(pending_mutex);
+				building_v.swap(pending_v);
+				building_f.swap(pending_f);
+				building_g.swap(pending_g);
+				pending = false;
+			}
+			building = startBuild(building_v, building_f, building_g);
+		}
+
+		if (!buildReady(building))
+			return false;
+
+		unsigned int program = finishBuild(building);
+		building = Build();
+		if (program == 0)
+		{
+			std::cout << "Shader reload failed, keeping previous program" << std::endl;
+			return false;
+		}
+
+		glDeleteProgram(ID);
+		ID = program;
+		v_code.swap(building_v);
+		f_code.swap(building_f);
+		g_code.swap(building_g);
+		std::cout << "Shader reloaded: " << vertex_path << ", " << fragment_path << std::endl;
+		return true;
 	}
 
 	/*
@@ -246,7 +270,315 @@ public:
 
 
 private:
-	void checkCompileErrors(unsigned int shader, std::string type)
+	std::string vertex_path, fragment_path, geometry_path;
+	std::string v_code, f_code, g_code;
+
+	// Hot reload state, filled by the watcher thread and consumed by reload()
+	std::thread watcher;
+	std::atomic<bool> watching{ false };
+	std::atomic<bool> pending{ false };
+	std::mutex pending_mutex;
+	std::string pending_v, pending_f, pending_g;
+
+	// Program being compiled by reload(), 0 when none
+	struct Build
+	{
+		unsigned int program = 0;
+		unsigned int shaders[3] = { 0, 0, 0 };
+		uint64_t key = 0;
+		bool cached = false;
+	};
+	Build building;
+	std::string building_v, building_f, building_g;
+
+	static bool readFile(const char* file, std::string &code)
+	{
+		std::ifstream stream;
+		stream.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		try
+		{
+			stream.open(file);
+			std::stringstream buffer;
+			buffer << stream.rdbuf();
+			stream.close();
+			code = buffer.str();
+		}
+		catch (std::ifstream::failure e)
+		{
+			return false;
+		}
+		return true;
+	}
+
+	// Modification time in nanoseconds where the platform has it, plus size,
+	// so two saves within the same second are still told apart
+	struct FileStamp
+	{
+		long long time = 0;
+		long long size = 0;
+
+		bool operator==(const FileStamp &o) const { return time == o.time && size == o.size; }
+	};
+
+	static FileStamp modifiedTime(const std::string &file)
+	{
+		FileStamp stamp;
+		struct stat info;
+		if (file.empty() || stat(file.c_str(), &info) != 0)
+			return stamp;
+
+#if defined(__APPLE__)
+		stamp.time = (long long)info.st_mtimespec.tv_sec * 1000000000ll + info.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+		stamp.time = (long long)info.st_mtime * 1000000000ll;
+#else
+		stamp.time = (long long)info.st_mtim.tv_sec * 1000000000ll + info.st_mtim.tv_nsec;
+#endif
+		stamp.size = (long long)info.st_size;
+		return stamp;
+	}
+
+	void watchFiles()
+	{
+		FileStamp v_time = modifiedTime(vertex_path);
+		FileStamp f_time = modifiedTime(fragment_path);
+		FileStamp g_time = modifiedTime(geometry_path);
+
+		while (watching)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+			FileStamp v_now = modifiedTime(vertex_path);
+			FileStamp f_now = modifiedTime(fragment_path);
+			FileStamp g_now = modifiedTime(geometry_path);
+			if (v_now == v_time && f_now == f_time && g_now == g_time)
+				continue;
+
+			// Editors can leave a file half written, try again next poll if so
+			std::string v, f, g;
+			if (!readFile(vertex_path.c_str(), v) || !readFile(fragment_path.c_str(), f))
+				continue;
+			if (!geometry_path.empty() && !readFile(geometry_path.c_str(), g))
+				continue;
+
+			v_time = v_now;
+			f_time = f_now;
+			g_time = g_now;
+
+			std::lock_guard<std::mutex> lock(pending_mutex);
+			pending_v.swap(v);
+			pending_f.swap(f);
+			pending_g.swap(g);
+			pending = true;
+		}
+	}
+
+	// Returns the linked program, or 0 if it failed
+	unsigned int build(const std::string &v, const std::string &f, const std::string &g)
+	{
+		Build b = startBuild(v, f, g);
+		return finishBuild(b);
+	}
+
+	// Load from the cache or submit the compile and link, without waiting for either
+	Build startBuild(const std::string &v, const std::string &f, const std::string &g)
+	{
+		Build b;
+		b.key = cacheKey(v, f, g);
+
+		b.program = glCreateProgram();
+		if (loadBinary(b.program, b.key))
+		{
+			b.cached = true;
+			return b;
+		}
+
+		// Binary missing or rejected by the driver, compile from source
+		glDeleteProgram(b.program);
+		b.program = glCreateProgram();
+
+		const std::string *sources[3] = { &v, &f, &g };
+		const GLenum types[3] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER, GL_GEOMETRY_SHADER };
+		for (int i = 0; i < 3; i++)
+		{
+			// Geometry Shader is optional
+			if (sources[i]->empty() && types[i] == GL_GEOMETRY_SHADER)
+				continue;
+
+			const char* code = sources[i]->c_str();
+			b.shaders[i] = glCreateShader(types[i]);
+			glShaderSource(b.shaders[i], 1, &code, NULL);
+			glCompileShader(b.shaders[i]);
+			glAttachShader(b.program, b.shaders[i]);
+		}
+
+		// Link Shaders
+		setRetrievable(b.program);
+		glLinkProgram(b.program);
+		return b;
+	}
+
+	// True once querying the build's status won't stall
+	static bool buildReady(const Build &b)
+	{
+		if (b.cached)
+			return true;
+#ifdef GL_KHR_parallel_shader_compile
+		if (GLAD_GL_KHR_parallel_shader_compile)
+		{
+			int done = 0;
+			glGetProgramiv(b.program, GL_COMPLETION_STATUS_KHR, &done);
+			return done != 0;
+		}
+#endif
+		return true;
+	}
+
+	// Check a started build, returns the program or 0 if it failed
+	unsigned int finishBuild(Build &b)
+	{
+		if (b.cached)
+			return b.program;
+
+		const char* names[3] = { "VERTEX", "FRAGMENT", "GEOMETRY" };
+		for (int i = 0; i < 3; i++)
+			if (b.shaders[i] != 0)
+				checkCompileErrors(b.shaders[i], names[i]);
+		bool linked = checkCompileErrors(b.program, "PROGRAM");
+
+		// Delete once finished
+		for (int i = 0; i < 3; i++)
+			if (b.shaders[i] != 0)
+				glDeleteShader(b.shaders[i]);
+
+		if (!linked)
+		{
+			glDeleteProgram(b.program);
+			return 0;
+		}
+
+		saveBinary(b.program, b.key);
+		return b.program;
+	}
+
+	// FNV-1a over the sources and driver strings, a driver update invalidates the cache
+	static uint64_t cacheKey(const std::string &v, const std::string &f, const std::string &g)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		auto add = [&](const char* text)
+		{
+			for (const char* c = text ? text : ""; *c; c++)
+				hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+			hash = (hash ^ 0xff) * 1099511628211ull; // Separator so "ab" + "c" != "a" + "bc"
+		};
+
+		add(v.c_str());
+		add(f.c_str());
+		add(g.c_str());
+		add((const char*)glGetString(GL_VENDOR));
+		add((const char*)glGetString(GL_RENDERER));
+		add((const char*)glGetString(GL_VERSION));
+		return hash;
+	}
+
+	static std::string cachePath(uint64_t key)
+	{
+		char name[32];
+		std::snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+		return std::string(SHADER_CACHE_DIR) + "/" + name;
+	}
+
+	// Program binaries need GL 4.1 or ARB_get_program_binary, and at least one format
+	static bool binaryCacheAvailable()
+	{
+		bool available = false;
+#ifdef GL_VERSION_4_1
+		available = available || GLAD_GL_VERSION_4_1;
+#endif
+#ifdef GL_ARB_get_program_binary
+		available = available || GLAD_GL_ARB_get_program_binary;
+#endif
+#if defined(GL_VERSION_4_1) || defined(GL_ARB_get_program_binary)
+		if (available)
+		{
+			int formats = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			available = formats > 0;
+		}
+#endif
+		return available;
+	}
+
+	static void setRetrievable(unsigned int program)
+	{
+#if defined(GL_VERSION_4_1) || defined(GL_ARB_get_program_binary)
+		if (binaryCacheAvailable())
+			glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
+	}
+
+	// Cache file is the binary format followed by the program binary
+	static bool loadBinary(unsigned int program, uint64_t key)
+	{
+#if defined(GL_VERSION_4_1) || defined(GL_ARB_get_program_binary)
+		if (!binaryCacheAvailable())
+			return false;
+
+		std::ifstream file(cachePath(key), std::ios::binary);
+		if (!file.is_open())
+			return false;
+
+		GLenum format;
+		if (!file.read((char*)&format, sizeof(format)))
+			return false;
+
+		std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (binary.empty())
+			return false;
+
+		glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+
+		int success;
+		glGetProgramiv(program, GL_LINK_STATUS, &success);
+		return success != 0;
+#else
+		return false;
+#endif
+	}
+
+	static void saveBinary(unsigned int program, uint64_t key)
+	{
+#if defined(GL_VERSION_4_1) || defined(GL_ARB_get_program_binary)
+		if (!binaryCacheAvailable())
+			return;
+
+		int length = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0)
+			return;
+
+		std::vector<char> binary(length);
+		GLenum format;
+		glGetProgramBinary(program, length, NULL, &format, binary.data());
+
+#ifdef _WIN32
+		_mkdir(SHADER_CACHE_DIR);
+#else
+		mkdir(SHADER_CACHE_DIR, 0755);
+#endif
+		std::ofstream file(cachePath(key), std::ios::binary);
+		if (!file.is_open())
+		{
+			std::cout << "Cannot write shader cache: " << cachePath(key) << std::endl;
+			return;
+		}
+
+		file.write((const char*)&format, sizeof(format));
+		file.write(binary.data(), binary.size());
+#endif
+	}
+
+	bool checkCompileErrors(unsigned int shader, std::string type)
 	{
 		int success;
 		char infoLog[1024];
@@ -268,6 +600,7 @@ private:
 				std::cout << "ERROR::PROGRAM_LINKING_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
 			}
 		}
+		return success != 0;
 	}
 };
-#endif
\ No newline at end of file
+#endif
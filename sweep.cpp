@@ -0,0 +1,329 @@
+// Headless parameter sweep
+// Runs one independent world per parameter set across all cores and writes
+// per-run metrics to CSV (or a packed binary file with --binary).
+//
+// Usage: sweep <spec file> <output file> [--threads N] [--binary]
+//
+// Spec file, one key per line, every combination of values is run:
+//	ticks 600
+//	tick_rate 60
+//	radius 1.0
+//	floor -4
+//	restitution 0.5 0.75 1.0	(or a range - start:end:step, end may be below start)
+//	gravity -0.0098 -0.005
+//	pos 0 0 -4				(repeat the line for more start positions)
+//	vel 0 0 0				(repeat the line for more start velocities)
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+
+#include "physics.h"
+
+struct SweepSpec
+{
+	int ticks = 600;
+	int tick_rate = 60;
+	float radius = 1.0;
+	float floor_y = -4.0;
+
+	std::vector<float> restitution;
+	std::vector<float> gravity;
+	std::vector<glm::vec3> pos;
+	std::vector<glm::vec3> vel;
+};
+
+struct RunParams
+{
+	float restitution;
+	float gravity;
+	glm::vec3 pos;
+	glm::vec3 vel;
+};
+
+// Fixed layout so the binary output is just an array of these
+struct RunResult
+{
+	float restitution;
+	float gravity;
+	float pos[3];
+	float vel[3];
+
+	int32_t bounces;
+	float first_bounce_height; // Peak height above the floor after the first bounce
+	float max_bounce_height; // Highest peak after any bounce
+	int32_t settle_tick; // First tick the ball stops rebounding, -1 if it never does
+	float energy; // Energy per unit mass at the end of the run
+};
+
+// Read values from a line, "a:b:s" expands to a range
+void readValues(std::istringstream &line, std::vector<float> &out)
+{
+	std::string token;
+	while (line >> token)
+	{
+		size_t a = token.find(":");
+		if (a == std::string::npos)
+		{
+			out.push_back(std::stof(token));
+			continue;
+		}
+
+		size_t b = token.find(":", a + 1);
+		float start = std::stof(token.substr(0, a));
+		float end = std::stof(token.substr(a + 1, b - a - 1));
+		float step = b == std::string::npos ? 1.0f : std::stof(token.substr(b + 1));
+
+		if (step <= 0)
+		{
+			std::cout << "Invalid range step: " << token << std::endl;
+			continue;
+		}
+
+		// Runs downwards when end is below start
+		if (end < start)
+			step = -step;
+
+		// Count steps rather than accumulate so the end point is not lost to rounding,
+		// rounded down so the last value never passes end
+		int count = (int)std::floor((end - start) / step + 1e-4f);
+		for (int i = 0; i <= count; i++)
+			out.push_back(start + step * i);
+	}
+}
+
+bool loadSpec(const std::string &filename, SweepSpec &spec)
+{
+	std::ifstream file(filename);
+	if (!file.is_open())
+	{
+		std::cout << "Cannot open file: " << filename << std::endl;
+		return false;
+	}
+
+	std::string text;
+	while (std::getline(file, text))
+	{
+		std::istringstream line(text);
+		std::string key;
+		if (!(line >> key) || key[0] == '#')
+			continue;
+
+		if (key == "ticks")
+			line >> spec.ticks;
+		else if (key == "tick_rate")
+			line >> spec.tick_rate;
+		else if (key == "radius")
+			line >> spec.radius;
+		else if (key == "floor")
+			line >> spec.floor_y;
+		else if (key == "restitution")
+			readValues(line, spec.restitution);
+		else if (key == "gravity")
+			readValues(line, spec.gravity);
+		else if (key == "pos" || key == "vel")
+		{
+			glm::vec3 v;
+			line >> v.x >> v.y >> v.z;
+			if (key == "pos")
+				spec.pos.push_back(v);
+			else
+				spec.vel.push_back(v);
+		}
+		else
+			std::cout << "Unknown sweep key: " << key << std::endl;
+	}
+
+	// Fall back to the viewer defaults for anything not swept
+	BodyParams defaults;
+	if (spec.restitution.empty())
+		spec.restitution.push_back((float)defaults.restitution);
+	if (spec.gravity.empty())
+		spec.gravity.push_back((float)defaults.gravity.y);
+	if (spec.pos.empty())
+		spec.pos.push_back(glm::vec3(0, 0, -4));
+	if (spec.vel.empty())
+		spec.vel.push_back(glm::vec3(0, 0, 0));
+
+	return true;
+}
+
+// Build the full grid of parameter sets
+std::vector<RunParams> expandSpec(const SweepSpec &spec)
+{
+	std::vector<RunParams> runs;
+	runs.reserve(spec.restitution.size() * spec.gravity.size() * spec.pos.size() * spec.vel.size());
+
+	for (float r : spec.restitution)
+		for (float g : spec.gravity)
+			for (const glm::vec3 &p : spec.pos)
+				for (const glm::vec3 &v : spec.vel)
+					runs.push_back({ r, g, p, v });
+
+	return runs;
+}
+
+RunResult runWorld(const SweepSpec &spec, const RunParams &run)
+{
+	Real timestep = Real(1 / (float)spec.tick_rate);
+
+	BodyParams params;
+	params.gravity = Vec3<Real>(Real(0), Real(run.gravity), Real(0));
+	params.restitution = Real(run.restitution);
+	params.floor_y = Real(spec.floor_y);
+
+	Body body;
+	body.pos = Vec3<Real>(run.pos);
+	body.velocity = Vec3<Real>(run.vel);
+	body.rad = Real(spec.radius);
+
+	RunResult result = {};
+	result.restitution = run.restitution;
+	result.gravity = run.gravity;
+	for (int i = 0; i < 3; i++)
+	{
+		result.pos[i] = run.pos[i];
+		result.vel[i] = run.vel[i];
+	}
+	result.settle_tick = -1;
+
+	const Real settled = Real(0.001);
+	Real peak = Real(0);
+	bool first_done = false; // First bounce height recorded
+	for (int tick = 0; tick < spec.ticks; tick++)
+	{
+		if (stepBody(body, params, timestep))
+		{
+			// Close off the previous bounce
+			if (result.bounces == 1 && !first_done)
+			{
+				result.first_bounce_height = (float)peak;
+				first_done = true;
+			}
+			if ((float)peak > result.max_bounce_height)
+				result.max_bounce_height = (float)peak;
+			peak = Real(0);
+
+			// Same threshold the viewer uses to stop reporting collisions
+			if (body.velocity.y > settled)
+				result.bounces++;
+			else if (result.settle_tick < 0)
+				result.settle_tick = tick;
+		}
+		else if (result.bounces > 0)
+		{
+			Real height = body.pos.y - body.rad - params.floor_y;
+			if (height > peak)
+				peak = height;
+		}
+	}
+
+	// Bounce still in the air when the run ended
+	if (result.bounces == 1 && !first_done)
+		result.first_bounce_height = (float)peak;
+	if ((float)peak > result.max_bounce_height)
+		result.max_bounce_height = (float)peak;
+
+	// Velocity is per tick and gravity adds g * timestep to it each tick
+	Real height = body.pos.y - body.rad - params.floor_y;
+	Real speed_sq = body.velocity.x * body.velocity.x + body.velocity.y * body.velocity.y + body.velocity.z * body.velocity.z;
+	result.energy = 0.5f * (float)speed_sq - (float)(params.gravity.y * timestep * height);
+
+	return result;
+}
+
+void writeCSV(std::ofstream &file, const std::vector<RunResult> &results)
+{
+	file << "run,restitution,gravity,pos_x,pos_y,pos_z,vel_x,vel_y,vel_z,bounces,first_bounce_height,max_bounce_height,settle_tick,energy\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const RunResult &r = results[i];
+		file << i << ',' << r.restitution << ',' << r.gravity << ','
+			<< r.pos[0] << ',' << r.pos[1] << ',' << r.pos[2] << ','
+			<< r.vel[0] << ',' << r.vel[1] << ',' << r.vel[2] << ','
+			<< r.bounces << ',' << r.first_bounce_height << ',' << r.max_bounce_height << ','
+			<< r.settle_tick << ',' << r.energy << '\n';
+	}
+}
+
+// "PSWP", record count, record size, then the RunResult array
+void writeBinary(std::ofstream &file, const std::vector<RunResult> &results)
+{
+	uint32_t count = (uint32_t)results.size();
+	uint32_t size = sizeof(RunResult);
+	file.write("PSWP", 4);
+	file.write((const char*)&count, sizeof(count));
+	file.write((const char*)&size, sizeof(size));
+	file.write((const char*)results.data(), results.size() * sizeof(RunResult));
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3)
+	{
+		std::cout << "Usage: sweep <spec file> <output file> [--threads N] [--binary]" << std::endl;
+		return -1;
+	}
+
+	int threads = std::thread::hardware_concurrency();
+	bool binary = false;
+	for (int i = 3; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = std::atoi(argv[++i]);
+		else if (std::strcmp(argv[i], "--binary") == 0)
+			binary = true;
+	}
+	if (threads < 1)
+		threads = 1;
+
+	SweepSpec spec;
+	if (!loadSpec(argv[1], spec))
+		return -1;
+
+	std::vector<RunParams> runs = expandSpec(spec);
+	std::vector<RunResult> results(runs.size());
+	std::cout << "Running " << runs.size() << " worlds on " << threads << " threads" << std::endl;
+
+	auto start = std::chrono::steady_clock::now();
+
+	// Each worker takes the next unclaimed run, worlds share nothing so no other locking
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&]()
+		{
+			for (size_t i = next++; i < runs.size(); i = next++)
+				results[i] = runWorld(spec, runs[i]);
+		});
+	}
+	for (std::thread &worker : workers)
+		worker.join();
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Finished in " << elapsed.count() << "s" << std::endl;
+
+	std::ofstream file(argv[2], binary ? std::ios::binary : std::ios::out);
+	if (!file.is_open())
+	{
+		std::cout << "Cannot open file: " << argv[2] << std::endl;
+		return -1;
+	}
+
+	if (binary)
+		writeBinary(file, results);
+	else
+		writeCSV(file, results);
+
+	return 0;
+}
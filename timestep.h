@@ -0,0 +1,128 @@
+#ifndef TIMESTEP_H
+#define TIMESTEP_H
+
+#include <chrono>
+#include <cmath>
+
+// Fixed timestep accumulator that can't fall into a spiral of death.
+// Real time is banked each frame and spent on fixed size ticks, but a frame
+// runs only as many ticks as fit in the time budget, judged from the measured
+// cost of recent ticks, and no more than a frame's worth plus a little slack.
+// Backlog left over after that is dropped, so the simulation runs slower than
+// real time instead of the frame time growing without bound.
+class TimestepController
+{
+public:
+	// Extra ticks a frame may run beyond its share, to catch up after a late frame
+	static const int HEADROOM = 2;
+
+	// frame_time is the target time between frames, budget the share of it
+	// that may be spent on physics
+	TimestepController(float tick_time, float frame_time, float budget = 0.5f) :
+		tick_time(tick_time), budget_share(budget)
+	{
+		setFrameTime(frame_time);
+	}
+
+	// Call when the target frame rate changes
+	void setFrameTime(float t)
+	{
+		frame_time = t;
+		max_steps = (int)std::ceil(frame_time / tick_time) + HEADROOM;
+		budget = frame_time * budget_share;
+	}
+
+	void setTickTime(float t)
+	{
+		tick_time = t;
+		setFrameTime(frame_time);
+	}
+
+	float tickTime() const { return tick_time; }
+
+	// Bank delta_time and call tick() for each fixed step due, returns how many ran
+	template<typename F>
+	int run(float delta_time, F tick)
+	{
+		buffer += delta_time;
+
+		int due = (int)(buffer / tick_time);
+		int steps = due < max_steps ? due : max_steps;
+
+		// Don't start ticks the budget can't pay for, but always run one so the sim never stops
+		if (tick_cost > 0)
+		{
+			int affordable = (int)(budget / tick_cost);
+			if (affordable < 1)
+				affordable = 1;
+			if (steps > affordable)
+				steps = affordable;
+		}
+
+		auto frame_start = std::chrono::steady_clock::now();
+		int ran = 0;
+		while (ran < steps)
+		{
+			auto start = std::chrono::steady_clock::now();
+			tick();
+			auto end = std::chrono::steady_clock::now();
+			float cost = std::chrono::duration<float>(end - start).count();
+
+			// Smoothed so one slow tick doesn't halve the next frame
+			tick_cost = tick_cost > 0 ? tick_cost + (cost - tick_cost) * 0.1f : cost;
+			buffer -= tick_time;
+			ran++;
+
+			// Ticks suddenly got slower than the estimate, stop when the budget is gone
+			if (std::chrono::duration<float>(end - frame_start).count() >= budget)
+				break;
+		}
+
+		// Drop whatever is still owed beyond the part of a tick carried to the next frame.
+		// Only when ticks were cut short, a remainder a rounding error short of a tick isn't backlog
+		behind = ran < due && buffer >= tick_time;
+		if (behind)
+		{
+			float owed = buffer - tick_time * (int)(buffer / tick_time);
+			dropped += buffer - owed;
+			buffer = owed;
+		}
+
+		// Simulated time per real second, smoothed over roughly the last second
+		if (delta_time > 0)
+		{
+			float ratio = ran * tick_time / delta_time;
+			float blend = delta_time < 1 ? delta_time : 1;
+			speed += (ratio - speed) * blend;
+		}
+
+		return ran;
+	}
+
+	// True when the last frame could not keep up and dropped time
+	bool isBehind() const { return behind; }
+
+	// Simulated seconds per real second, 1 when keeping up
+	float simSpeed() const { return speed; }
+
+	// Total simulated time skipped since start, in seconds
+	float droppedTime() const { return dropped; }
+
+	// Smoothed wall time of one tick, in seconds
+	float tickCost() const { return tick_cost; }
+
+private:
+	float tick_time;
+	float frame_time;
+	float budget_share;
+	int max_steps;
+	float budget; // Seconds of physics per frame
+
+	float buffer = 0;
+	float tick_cost = 0;
+	float dropped = 0;
+	float speed = 1;
+	bool behind = false;
+};
+
+#endif